@@ -0,0 +1,280 @@
+/**
+ * Pattern cache - keeps the last few patterns regex() compiled so calling it over and over with
+ * the same pattern only compiles it once.
+ *
+ * Patterns are kept by (pattern, options) in CACHE_SHARDS shards, picked by the pattern's hash.
+ * Each shard has its own lock and keeps CACHE_SHARD_SIZE patterns, pushing out the least recently
+ * used one when it's full. Finding a pattern that's already there only takes the lock shared, so
+ * threads using the same patterns don't wait on each other either. Rather than moving the pattern
+ * to the front, which would need the lock to itself, a hit stamps it with the shard's clock and
+ * whatever has the oldest stamp is the one pushed out. Compiling happens outside the lock.
+ *
+ * A pattern can get pushed out while another thread is still matching with it, so every entry
+ * counts the callers using it, plus one for the cache while it's in there. Whoever drops the last
+ * one frees it
+ */
+
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Datatypes *****/
+typedef struct CacheEntry_ {
+    struct CacheEntry_ *prev; // Most recently added first
+    struct CacheEntry_ *next;
+
+    char *pattern;
+    unsigned int opts;
+    unsigned int hash;
+    Regex *re;
+
+    int refs; // How many callers are matching with re right now, and the cache if it's still in there
+    unsigned long long used; // The shard's clock when it was last looked up
+} CacheEntry;
+
+typedef struct CacheShard_ {
+    pthread_rwlock_t lock; // Only held exclusively to add or take out patterns
+    struct CacheEntry_ *head;
+    struct CacheEntry_ *tail;
+    int n;
+    unsigned long long clock; // Goes up by one for every lookup that finds or adds a pattern
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} CacheShard;
+
+
+
+/***** Constants *****/
+static CacheShard shards[CACHE_SHARDS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+
+
+/***** Function Prototypes *****/
+Regex *cache_get(char *pattern, unsigned int opts, CacheEntry **entry);
+void cache_release(CacheEntry *e);
+void regex_cache_stats(RegexCacheStats *stats);
+void regex_cache_clear(void);
+
+static void cache_init(void);
+static unsigned int cache_hash(const char *pattern, unsigned int opts);
+static CacheEntry *cache_find(CacheShard *sh, const char *pattern, unsigned int opts, unsigned int hash);
+static void cache_unlink(CacheShard *sh, CacheEntry *e);
+static void cache_push_front(CacheShard *sh, CacheEntry *e);
+static void cache_use(CacheShard *sh, CacheEntry *e);
+static CacheEntry *cache_oldest(CacheShard *sh);
+static void cache_evict(CacheShard *sh, CacheEntry *e);
+static void cache_unref(CacheEntry *e);
+static void free_entry(CacheEntry *e);
+
+
+
+/**
+ * Returns the compiled pattern, compiling it if it isn't in the cache. NULL if the pattern is bad
+ * entry has to go back to cache_release once the caller is done with the Regex
+ */
+Regex *cache_get(char *pattern, unsigned int opts, CacheEntry **entry) {
+    pthread_once(&cache_once, cache_init);
+
+    unsigned int hash = cache_hash(pattern, opts);
+    CacheShard *sh = &shards[hash % CACHE_SHARDS];
+
+    // Nothing can be taken out while it's held shared, so e is safe to hand out once it's found
+    pthread_rwlock_rdlock(&sh->lock);
+    CacheEntry *e = cache_find(sh, pattern, opts, hash);
+    if (e != NULL) {
+        __atomic_add_fetch(&sh->hits, 1, __ATOMIC_RELAXED);
+        cache_use(sh, e);
+        pthread_rwlock_unlock(&sh->lock);
+
+        *entry = e;
+        return e->re;
+    }
+    __atomic_add_fetch(&sh->misses, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&sh->lock);
+
+    // Bad patterns aren't kept, so they complain every time like they always have
+    Regex *re = regex_compile(pattern, opts);
+    if (re == NULL)
+        return NULL;
+
+    e = malloc(sizeof(CacheEntry));
+    e->pattern = strdup(pattern);
+    e->opts = opts;
+    e->hash = hash;
+    e->re = re;
+    e->refs = 1; // The cache's, cache_use adds ours
+
+    pthread_rwlock_wrlock(&sh->lock);
+
+    // Somebody else compiled it while we were, theirs is the one that stays
+    CacheEntry *other = cache_find(sh, pattern, opts, hash);
+    if (other != NULL) {
+        cache_use(sh, other);
+        pthread_rwlock_unlock(&sh->lock);
+
+        free_entry(e);
+        *entry = other;
+        return other->re;
+    }
+
+    cache_use(sh, e);
+    if (sh->n == CACHE_SHARD_SIZE)
+        cache_evict(sh, cache_oldest(sh));
+    cache_push_front(sh, e);
+    pthread_rwlock_unlock(&sh->lock);
+
+    *entry = e;
+    return re;
+}
+
+// Done with what cache_get handed out
+void cache_release(CacheEntry *e) {
+    cache_unref(e);
+}
+
+void regex_cache_stats(RegexCacheStats *stats) {
+    pthread_once(&cache_once, cache_init);
+    memset(stats, 0, sizeof(RegexCacheStats));
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *sh = &shards[i];
+
+        pthread_rwlock_rdlock(&sh->lock);
+        stats->hits += __atomic_load_n(&sh->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&sh->misses, __ATOMIC_RELAXED);
+        stats->evictions += sh->evictions;
+        stats->entries += sh->n;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+}
+
+// Anything still being matched with gets freed when its caller is done with it
+void regex_cache_clear(void) {
+    pthread_once(&cache_once, cache_init);
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *sh = &shards[i];
+        CacheEntry *free_list = NULL;
+
+        pthread_rwlock_wrlock(&sh->lock);
+        while (sh->head != NULL) {
+            CacheEntry *e = sh->head;
+            cache_unlink(sh, e);
+            if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+                e->next = free_list;
+                free_list = e;
+            }
+        }
+        sh->hits = sh->misses = sh->evictions = 0;
+        pthread_rwlock_unlock(&sh->lock);
+
+        while (free_list != NULL) {
+            CacheEntry *tmp = free_list->next;
+            free_entry(free_list);
+            free_list = tmp;
+        }
+    }
+}
+
+static void cache_init(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(CacheShard));
+        pthread_rwlock_init(&shards[i].lock, NULL);
+    }
+}
+
+// FNV-1a over the pattern with the options mixed in at the end
+static unsigned int cache_hash(const char *pattern, unsigned int opts) {
+    unsigned int hash = 2166136261u;
+
+    for (const unsigned char *p = (const unsigned char *) pattern; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    hash ^= opts;
+    hash *= 16777619u;
+
+    return hash;
+}
+
+// The shard is only ever a handful of patterns so it's just a walk down the list
+static CacheEntry *cache_find(CacheShard *sh, const char *pattern, unsigned int opts, unsigned int hash) {
+    for (CacheEntry *e = sh->head; e != NULL; e = e->next)
+        if (e->hash == hash && e->opts == opts && !strcmp(e->pattern, pattern))
+            return e;
+
+    return NULL;
+}
+
+static void cache_unlink(CacheShard *sh, CacheEntry *e) {
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        sh->head = e->next;
+
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        sh->tail = e->prev;
+
+    sh->n--;
+}
+
+static void cache_push_front(CacheShard *sh, CacheEntry *e) {
+    e->prev = NULL;
+    e->next = sh->head;
+
+    if (sh->head != NULL)
+        sh->head->prev = e;
+    else
+        sh->tail = e;
+
+    sh->head = e;
+    sh->n++;
+}
+
+// Another caller for e, and it's the most recently used now. Called with the lock held either way
+static void cache_use(CacheShard *sh, CacheEntry *e) {
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->used, __atomic_add_fetch(&sh->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+// The least recently used entry, called with the lock held exclusively so the stamps stay put
+static CacheEntry *cache_oldest(CacheShard *sh) {
+    CacheEntry *oldest = sh->tail;
+
+    for (CacheEntry *e = sh->tail; e != NULL; e = e->prev)
+        if (e->used < oldest->used)
+            oldest = e;
+
+    return oldest;
+}
+
+// Takes e out of the cache, it's only freed now if nobody is using it. Called with the lock held
+static void cache_evict(CacheShard *sh, CacheEntry *e) {
+    cache_unlink(sh, e);
+    sh->evictions++;
+    cache_unref(e);
+}
+
+// Whoever lets go of the last reference frees it
+static void cache_unref(CacheEntry *e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free_entry(e);
+}
+
+static void free_entry(CacheEntry *e) {
+    regex_free(e->re);
+    free(e->pattern);
+    free(e);
+}
@@ -0,0 +1,801 @@
+/**
+ * Lazy DFA - used when all we care about is whether there's a match or not.
+ *
+ * A DFA state is the set of pike VM threads that are alive at some point in the input.
+ * The captures don't matter here so two points with the same set of states behave
+ * exactly the same, which means the transitions can be worked out once and cached.
+ * States and transitions are only built when the input actually needs them.
+ *
+ * Keeping the same answers as regex_exec:
+ *  - A thread that reaches S_FINAL after consuming something is a match, we can stop there
+ *  - A thread that reaches S_FINAL before consuming anything is an empty match, which
+ *    regex_exec throws away. It still cuts off everything below it for that start though,
+ *    so the states added for a new start are only the ones before the first S_FINAL.
+ *    That's the same every time so it's worked out once (start_ids)
+ *
+ * The cache is capped at mem_limit bytes. When it fills up everything gets thrown away
+ * and we carry on from the current state. If that keeps happening without getting
+ * through much input the DFA isn't helping, so we hand the string to the pike VM
+ *
+ * For a RegexSet we need to know which patterns matched rather than stopping at the first one.
+ * Each pattern has its own S_FINAL, so those get kept in the set of states as well and a
+ * DFA state with any in it says which patterns have just matched
+ *
+ * regex_match_parallel gives each thread a DFA of its own and runs pieces of the input
+ * from states other than the start with dfa_exec_chunk, see parallel.c
+ * regex_match_batch steps DFA_BATCH_LANES inputs through the same cache side by side
+ * regexc gets every state worked out up front with dfa_build so it can write the DFA out as C
+ */
+
+
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Defines *****/
+#define DFA_HASH_SIZE          4096
+#define DFA_MIN_BYTES_PER_STATE 10 // Less than this between flushes and we give up
+#define DFA_BATCH_LANES        8  // How many inputs regex_match_batch has on the go at once
+
+// Stand-in for any transition that completes a match, never looked inside
+#define DFA_MATCH ((DfaState *) &dfa_match_sentinel)
+
+
+/***** Datatypes *****/
+typedef struct DfaState_ {
+    struct DfaState_ *next[256]; // NULL until the transition has been worked out
+    struct DfaState_ *hash_next;
+    unsigned int hash;
+    int accepts; // Has S_FINAL states in it, only happens for sets
+    int number; // Where dfa_build put it plus one, 0 if it hasn't
+    int n;
+    int ids[]; // Sorted ids of the states that consume input
+} DfaState;
+
+typedef struct DfaData_ {
+    DfaState *table[DFA_HASH_SIZE];
+    DfaState *start;   // Nothing in progress, just whatever a new start adds
+    DfaState *initial; // Where offset 0 starts, which is start plus anything anchored
+
+    size_t mem_used;
+    int n_dfa_states;
+
+    // Scratch used while building states
+    unsigned int *marks; // == gen if the state has been seen while building the current set
+    unsigned int gen;
+    int *dense;
+    int n;
+    uint32_t *stack;
+
+    int *start_ids; // Added at every offset
+    int n_start_ids;
+    int *initial_ids;
+    int n_initial_ids;
+    int *saved_ids; // Somewhere to keep the current state while the cache gets flushed
+
+    int keep_finals; // Matching a set, so S_FINAL states go in the set instead of stopping
+} DfaData;
+
+
+
+// One of the inputs going through dfa_exec_batch
+typedef struct DfaLane_ {
+    struct DfaState_ *d;
+    const char *string;
+    int pos;
+    int len;
+    int i; // Which input it is
+} DfaLane;
+
+
+
+/***** Constants *****/
+static char dfa_match_sentinel;
+
+
+
+/***** Function Prototypes *****/
+int dfa_exec(Regex *re, const char *string, int len);
+int dfa_exec_set(Regex *re, const char *string, int len, int *matched);
+int dfa_exec_chunk(Regex *re, DfaData *dd, const int *ids, int n, const char *string, int len, int *end_ids, int *n_end);
+DfaData *dfa_create(Regex *re, int new_starts);
+int dfa_start_ids(const DfaData *dd, const int **ids);
+void dfa_destroy(DfaData *dd);
+void dfa_exec_batch(Regex *re, DfaData *dd, const RegexInput *inputs, int n, int *results);
+int dfa_build(Regex *re, int whole, int max_states, int **next, int **accepts);
+
+static int dfa_lane_step(Regex *re, DfaData *dd, DfaLane *ln, unsigned long long *hits);
+static void dfa_drain_lanes(Regex *re, DfaData *dd, DfaLane *lanes, int n_lanes, int *results);
+
+static DfaData *dfa_data(Regex *re);
+static int dfa_run(Regex *re, DfaData *dd, DfaState **dp, const char *string, int len, int give_up);
+static DfaData *create_dfa_data(Regex *re, int new_starts);
+static void dfa_add_starts(Regex *re, DfaData *dd, int anchored);
+static void dfa_build_starts(Regex *re, DfaData *dd);
+static int *dfa_copy_ids(DfaData *dd);
+static void dfa_flush(DfaData *dd);
+static DfaState *dfa_restart(Regex *re, DfaData *dd, DfaState *d);
+static DfaState *dfa_state_from_ids(Regex *re, DfaData *dd, const int *ids, int n);
+static void dfa_new_set(Regex *re, DfaData *dd);
+static DfaState *dfa_next_state(Regex *re, DfaData *dd, DfaState *d, unsigned char ch);
+static DfaState *dfa_find_state(Regex *re, DfaData *dd);
+static int dfa_closure(Regex *re, DfaData *dd, uint32_t pc, int stop_at_final);
+static int dfa_step_matches(const Program *prog, const Inst *in, unsigned char ch);
+static int compare_ids(const void *a, const void *b);
+static void dfa_stats(DfaData *dd, unsigned long long hits);
+
+
+
+// Returns 1 if string has a (non-empty) match
+int dfa_exec(Regex *re, const char *string, int len) {
+    DfaData *dd = dfa_data(re);
+    DfaState *d = dd->initial;
+    int rtn = dfa_run(re, dd, &d, string, len, 1);
+
+    if (rtn == -1) {
+        regex_log("DFA is thrashing, falling back to the pike VM\n");
+        int caps[2 * MAX_CAPTURE_GROUPS];
+        return pike_exec(re, string, len, caps);
+    }
+
+    return rtn;
+}
+
+/**
+ * Sets matched[i] for every pattern i in the set that has a (non-empty) match in string
+ * Returns how many patterns matched
+ * There's nothing to fall back to if the cache thrashes so it just keeps flushing
+ */
+int dfa_exec_set(Regex *re, const char *string, int len, int *matched) {
+    DfaData *dd = dfa_data(re);
+    DfaState *d = dd->initial;
+    int n_matched = 0;
+    unsigned long long hits = 0;
+
+    for (int pos = 0; pos < len; pos++) {
+        if (d == dd->start) {
+            pos = scan_first(re, string, pos, len);
+            if (pos == len)
+                break;
+        }
+
+        DfaState *nd = d->next[(unsigned char) string[pos]];
+
+        if (nd == NULL) {
+            nd = dfa_next_state(re, dd, d, string[pos]);
+            regex_trace(REGEX_TRACE_DFA_MISS, dd->n_dfa_states, pos);
+
+            if (nd == NULL) {
+                regex_log("DFA cache full at offset %d, flushing\n", pos);
+                regex_trace(REGEX_TRACE_DFA_FLUSH, 0, pos);
+                d = dfa_restart(re, dd, d);
+                nd = dfa_next_state(re, dd, d, string[pos]);
+            }
+        } else {
+            hits++;
+        }
+
+        if (nd->accepts) {
+            for (int i = 0; i < nd->n; i++) {
+                const Inst *in = &re->prog.insts[nd->ids[i]];
+                if (in->op == OP_MATCH && !matched[in->arg]) {
+                    regex_log("Pattern %u matched at offset %d\n", in->arg, pos);
+                    regex_trace(REGEX_TRACE_MATCH, nd->ids[i], pos + 1);
+                    matched[in->arg] = 1;
+                    n_matched++;
+                }
+            }
+
+            // Nothing left to find
+            if (n_matched == re->n_set)
+                break;
+        }
+
+        if (nd->n == 0)
+            break;
+
+        d = nd;
+    }
+
+    dfa_stats(dd, hits);
+    return n_matched;
+}
+
+/**
+ * Runs a piece of the input from a given set of states instead of the start, for regex_match_parallel
+ * ids == NULL starts from wherever offset 0 would. The states it ended up in go in end_ids (room for
+ * every state) and how many there were in n_end. Returns 1 if there was a match in the piece
+ */
+int dfa_exec_chunk(Regex *re, DfaData *dd, const int *ids, int n, const char *string, int len, int *end_ids, int *n_end) {
+    DfaState *d = (ids == NULL) ? dd->initial : dfa_state_from_ids(re, dd, ids, n);
+    int rtn = dfa_run(re, dd, &d, string, len, 0);
+
+    *n_end = d->n;
+    memcpy(end_ids, d->ids, sizeof(int) * d->n);
+    return rtn;
+}
+
+/**
+ * A DFA of its own for running pieces of the input on another thread
+ * Without new_starts nothing gets started at each offset, so it only follows whatever was already going
+ */
+DfaData *dfa_create(Regex *re, int new_starts) {
+    return create_dfa_data(re, new_starts);
+}
+
+// The ids a new start adds at every offset, empty if the pattern is anchored or there are no new starts
+int dfa_start_ids(const DfaData *dd, const int **ids) {
+    *ids = dd->start_ids;
+    return dd->n_start_ids;
+}
+
+void dfa_destroy(DfaData *dd) {
+    if (dd == NULL)
+        return;
+
+    dfa_flush(dd);
+    free(dd->start_ids);
+    free(dd->initial_ids);
+    free(dd->saved_ids);
+    free(dd->marks);
+    free(dd->dense);
+    free(dd->stack);
+    free(dd);
+}
+
+/**
+ * regex_match for a lot of inputs, results[i] is 1 if inputs[i] has a match. dd == NULL uses this thread's usual DFA
+ * The inputs take turns a byte at a time, so while one is waiting on a transition to come out of
+ * memory the others have something to get on with
+ */
+void dfa_exec_batch(Regex *re, DfaData *dd, const RegexInput *inputs, int n, int *results) {
+    if (dd == NULL)
+        dd = dfa_data(re);
+
+    DfaLane lanes[DFA_BATCH_LANES];
+    int n_lanes = 0;
+    int next = 0;
+    unsigned long long hits = 0;
+
+    while (1) {
+        // Top up the lanes that finished last time round
+        while (n_lanes < DFA_BATCH_LANES && next < n) {
+            DfaLane *ln = &lanes[n_lanes];
+            ln->d = dd->initial;
+            ln->string = inputs[next].string;
+            ln->pos = 0;
+            ln->len = inputs[next].len > INT_MAX ? INT_MAX : (int) inputs[next].len;
+            ln->i = next++;
+
+            // Can't ever match, same as the check in dfa_run
+            if (ln->d->n == 0 && dd->n_start_ids == 0)
+                results[ln->i] = 0;
+            else
+                n_lanes++;
+        }
+
+        if (n_lanes == 0)
+            break;
+
+        for (int l = 0; l < n_lanes; ) {
+            DfaLane *ln = &lanes[l];
+            DfaState *nd;
+
+            // Almost every step is an already cached transition to a state that's still going
+            if (ln->d != dd->start && ln->pos < ln->len
+                    && (nd = ln->d->next[(unsigned char) ln->string[ln->pos]]) != NULL
+                    && nd != DFA_MATCH && nd->n != 0) {
+                ln->d = nd;
+                ln->pos++;
+                hits++;
+                l++;
+                continue;
+            }
+
+            int rtn = dfa_lane_step(re, dd, ln, &hits);
+
+            // The cache is full. Flushing it would pull the states out from under every other
+            // lane, so they all get finished off one at a time instead
+            if (rtn == -2) {
+                dfa_drain_lanes(re, dd, lanes, n_lanes, results);
+                n_lanes = 0;
+                break;
+            }
+
+            if (rtn >= 0) {
+                results[lanes[l].i] = rtn;
+                lanes[l] = lanes[--n_lanes];
+                continue;
+            }
+
+            l++;
+        }
+    }
+
+    dfa_stats(dd, hits);
+}
+
+/**
+ * Works out every state up front instead of as the input needs them, for regexc to write out
+ * Without whole it gives the same answer as regex_match. With whole the only start is at offset 0
+ * and the input matches if it ends in a state that accepts, S_FINAL goes in the set like it does for a RegexSet.
+ * States are numbered in the order they're found, 0 is where the input starts. next gets 256
+ * transitions a state, each a state number, DFA_TO_MATCH or DFA_TO_DEAD, and accepts gets 1 for a state
+ * the input can end in (only ever with whole). The DFA memory limit has to leave room for all of them
+ * Returns how many states there are, 0 if there'd be more than max_states
+ */
+int dfa_build(Regex *re, int whole, int max_states, int **next, int **accepts) {
+    DfaData *dd = create_dfa_data(re, !whole);
+    DfaState **found = malloc(sizeof(DfaState *) * max_states);
+    *next = malloc(sizeof(int) * 256 * max_states);
+    *accepts = malloc(sizeof(int) * max_states);
+
+    if (whole) {
+        dd->keep_finals = 1;
+        dfa_new_set(re, dd);
+        dfa_closure(re, dd, re->start->id, 0);
+        dd->initial = dfa_find_state(re, dd);
+    }
+
+    int n = 1;
+    found[0] = dd->initial;
+    found[0]->number = 1;
+
+    // States get added on the end as they're found, so this is a breadth first walk
+    for (int d = 0; d < n; d++) {
+        (*accepts)[d] = found[d]->accepts;
+
+        int ch;
+        for (ch = 0; ch < 256; ch++) {
+            DfaState *nd = dfa_next_state(re, dd, found[d], (unsigned char) ch);
+            if (nd == NULL)
+                break;
+
+            if (nd == DFA_MATCH) {
+                (*next)[d * 256 + ch] = DFA_TO_MATCH;
+                continue;
+            }
+            if (nd->n == 0) {
+                (*next)[d * 256 + ch] = DFA_TO_DEAD;
+                continue;
+            }
+
+            if (nd->number == 0) {
+                if (n == max_states)
+                    break;
+                found[n++] = nd;
+                nd->number = n;
+            }
+            (*next)[d * 256 + ch] = nd->number - 1;
+        }
+
+        // Too many states, or too many for the cache
+        if (ch < 256) {
+            n = 0;
+            break;
+        }
+    }
+
+    if (n == 0) {
+        free(*next);
+        free(*accepts);
+        *next = NULL;
+        *accepts = NULL;
+    }
+
+    free(found);
+    dfa_destroy(dd);
+    return n;
+}
+
+// This thread's DFA for re, the one that gets used when nobody says otherwise
+static DfaData *dfa_data(Regex *re) {
+    Scratch *sc = regex_scratch(re);
+    if (sc->dfa == NULL)
+        sc->dfa = create_dfa_data(re, 1);
+
+    return sc->dfa;
+}
+
+/**
+ * Runs the DFA over string starting from *dp, which is left on the state it finished in
+ * Returns 1 if there was a match and 0 if there wasn't. Stops early on a match or a dead state
+ * With give_up it returns -1 if the cache is thrashing, otherwise it just keeps flushing
+ */
+static int dfa_run(Regex *re, DfaData *dd, DfaState **dp, const char *string, int len, int give_up) {
+    DfaState *d = *dp;
+    int last_flush = -1;
+    int rtn = 0;
+    unsigned long long hits = 0;
+
+    // Nothing in progress and nothing new starting, so it can't ever match
+    if (d->n == 0 && dd->n_start_ids == 0)
+        return 0;
+
+    for (int pos = 0; pos < len; pos++) {
+        // Nothing in progress, so every byte that can't start a match leads straight back here
+        if (d == dd->start) {
+            pos = scan_first(re, string, pos, len);
+            if (pos == len)
+                break;
+        }
+
+        DfaState *nd = d->next[(unsigned char) string[pos]];
+
+        if (nd == NULL) {
+            nd = dfa_next_state(re, dd, d, string[pos]);
+            regex_trace(REGEX_TRACE_DFA_MISS, dd->n_dfa_states, pos);
+
+            // The cache is full, throw everything away and carry on from d
+            if (nd == NULL) {
+                regex_log("DFA cache full at offset %d, flushing\n", pos);
+                regex_trace(REGEX_TRACE_DFA_FLUSH, 0, pos);
+                if (give_up && last_flush >= 0 && pos - last_flush < DFA_MIN_BYTES_PER_STATE * dd->n_dfa_states) {
+                    rtn = -1;
+                    break;
+                }
+
+                d = dfa_restart(re, dd, d);
+                last_flush = pos;
+                nd = dfa_next_state(re, dd, d, string[pos]);
+            }
+        } else {
+            hits++;
+        }
+
+        if (nd == DFA_MATCH) {
+            regex_trace(REGEX_TRACE_MATCH, 0, pos + 1);
+            rtn = 1;
+            break;
+        }
+
+        d = nd;
+
+        // Dead state, nothing left that could ever match
+        if (d->n == 0)
+            break;
+    }
+
+    dfa_stats(dd, hits);
+    *dp = d;
+    return rtn;
+}
+
+/**
+ * Moves a lane on by a byte (or past the bytes that can't start a match)
+ * Returns 1 if it matched, 0 if it's done without a match, -1 if there's more to do
+ * and -2 if the transition needed wouldn't fit in the cache
+ */
+static int dfa_lane_step(Regex *re, DfaData *dd, DfaLane *ln, unsigned long long *hits) {
+    if (ln->d == dd->start)
+        ln->pos = scan_first(re, ln->string, ln->pos, ln->len);
+    if (ln->pos >= ln->len)
+        return 0;
+
+    DfaState *nd = ln->d->next[(unsigned char) ln->string[ln->pos]];
+    if (nd == NULL) {
+        nd = dfa_next_state(re, dd, ln->d, ln->string[ln->pos]);
+        regex_trace(REGEX_TRACE_DFA_MISS, dd->n_dfa_states, ln->pos);
+        if (nd == NULL)
+            return -2;
+    } else {
+        (*hits)++;
+    }
+
+    if (nd == DFA_MATCH) {
+        regex_trace(REGEX_TRACE_MATCH, 0, ln->pos + 1);
+        return 1;
+    }
+    if (nd->n == 0)
+        return 0;
+
+    ln->d = nd;
+    ln->pos++;
+    return -1;
+}
+
+// Takes a copy of where every lane is before anything gets flushed, then runs them to the end one by one
+static void dfa_drain_lanes(Regex *re, DfaData *dd, DfaLane *lanes, int n_lanes, int *results) {
+    int *ids = malloc(sizeof(int) * re->n_states * n_lanes);
+    int n[DFA_BATCH_LANES];
+
+    regex_log("DFA cache full with %d lanes going, finishing them off separately\n", n_lanes);
+    regex_trace(REGEX_TRACE_DFA_FLUSH, 0, lanes[0].pos);
+    for (int l = 0; l < n_lanes; l++) {
+        n[l] = lanes[l].d->n;
+        memcpy(ids + l * re->n_states, lanes[l].d->ids, sizeof(int) * n[l]);
+    }
+
+    for (int l = 0; l < n_lanes; l++) {
+        DfaLane *ln = &lanes[l];
+        DfaState *d = dfa_state_from_ids(re, dd, ids + l * re->n_states, n[l]);
+        results[ln->i] = dfa_run(re, dd, &d, ln->string + ln->pos, ln->len - ln->pos, 0);
+    }
+
+    free(ids);
+}
+
+static DfaData *create_dfa_data(Regex *re, int new_starts) {
+    DfaData *dd = malloc(sizeof(DfaData));
+    memset(dd->table, 0, sizeof(dd->table));
+    dd->mem_used = 0;
+    dd->n_dfa_states = 0;
+
+    dd->marks = calloc(re->n_states, sizeof(unsigned int));
+    dd->gen = 0;
+    dd->dense = malloc(sizeof(int) * re->n_states);
+    dd->stack = malloc(sizeof(uint32_t) * (2 * re->n_states + 1));
+    dd->saved_ids = malloc(sizeof(int) * re->n_states);
+    dd->keep_finals = (re->set != NULL);
+
+    // The states a new start adds are always the same so we only work them out once
+    dfa_new_set(re, dd);
+    if (new_starts)
+        dfa_add_starts(re, dd, 0);
+    dd->n_start_ids = dd->n;
+    dd->start_ids = dfa_copy_ids(dd);
+
+    // Then the anchored ones on top for offset 0
+    if (new_starts)
+        dfa_add_starts(re, dd, 1);
+    dd->n_initial_ids = dd->n;
+    dd->initial_ids = dfa_copy_ids(dd);
+
+    dfa_build_starts(re, dd);
+
+    return dd;
+}
+
+// Adds what starting at an offset adds, either the anchored patterns or the rest
+// In a set each pattern gets cut off at its own S_FINAL
+static void dfa_add_starts(Regex *re, DfaData *dd, int anchored) {
+    if (re->set == NULL) {
+        if (re->options.start_of_string == anchored)
+            dfa_closure(re, dd, re->start->id, 1);
+        return;
+    }
+
+    for (int i = 0; i < re->n_set; i++)
+        if (re->set[i].anchored == anchored)
+            dfa_closure(re, dd, re->set[i].start->id, 1);
+}
+
+// Makes the start and initial states from start_ids and initial_ids
+static void dfa_build_starts(Regex *re, DfaData *dd) {
+    dfa_new_set(re, dd);
+    dd->n = dd->n_start_ids;
+    memcpy(dd->dense, dd->start_ids, sizeof(int) * dd->n_start_ids);
+    dd->start = dfa_find_state(re, dd);
+
+    dfa_new_set(re, dd);
+    dd->n = dd->n_initial_ids;
+    memcpy(dd->dense, dd->initial_ids, sizeof(int) * dd->n_initial_ids);
+    dd->initial = dfa_find_state(re, dd);
+}
+
+static int *dfa_copy_ids(DfaData *dd) {
+    int *ids = malloc(sizeof(int) * (dd->n + 1));
+    memcpy(ids, dd->dense, sizeof(int) * dd->n);
+    return ids;
+}
+
+// Flushes the cache and rebuilds the start states and d, returns the new copy of d
+static DfaState *dfa_restart(Regex *re, DfaData *dd, DfaState *d) {
+    int n = d->n;
+    memcpy(dd->saved_ids, d->ids, sizeof(int) * n);
+    if (match_stats != NULL)
+        match_stats->dfa_flushes++;
+    dfa_flush(dd);
+    dfa_build_starts(re, dd);
+
+    return dfa_state_from_ids(re, dd, dd->saved_ids, n);
+}
+
+// Finds or makes the DFA state for a set of ids. The cache has to have room, or be freshly flushed
+static DfaState *dfa_state_from_ids(Regex *re, DfaData *dd, const int *ids, int n) {
+    dfa_new_set(re, dd);
+    dd->n = n;
+    memcpy(dd->dense, ids, sizeof(int) * n);
+
+    DfaState *d = dfa_find_state(re, dd);
+    if (d == NULL) {
+        if (match_stats != NULL)
+            match_stats->dfa_flushes++;
+        dfa_flush(dd);
+        dfa_build_starts(re, dd);
+
+        dfa_new_set(re, dd);
+        dd->n = n;
+        memcpy(dd->dense, ids, sizeof(int) * n);
+        d = dfa_find_state(re, dd);
+    }
+
+    return d;
+}
+
+// Throws away every cached state
+static void dfa_flush(DfaData *dd) {
+    for (int i = 0; i < DFA_HASH_SIZE; i++) {
+        DfaState *d = dd->table[i];
+        while (d != NULL) {
+            DfaState *tmp = d->hash_next;
+            free(d);
+            d = tmp;
+        }
+        dd->table[i] = NULL;
+    }
+    dd->start = NULL;
+    dd->initial = NULL;
+    dd->mem_used = 0;
+    dd->n_dfa_states = 0;
+}
+
+// Empties the set being built in dd->dense
+static void dfa_new_set(Regex *re, DfaData *dd) {
+    dd->n = 0;
+    if (++dd->gen == 0) {
+        memset(dd->marks, 0, sizeof(unsigned int) * re->n_states);
+        dd->gen = 1;
+    }
+}
+
+/**
+ * Works out where d goes on ch and caches it
+ * Returns NULL if there wasn't room in the cache
+ */
+static DfaState *dfa_next_state(Regex *re, DfaData *dd, DfaState *d, unsigned char ch) {
+    if (match_stats != NULL) {
+        match_stats->states++;
+        match_stats->dfa_misses++;
+    }
+
+    dfa_new_set(re, dd);
+
+    for (int i = 0; i < d->n; i++) {
+        const Inst *in = &re->prog.insts[d->ids[i]];
+        if (dfa_step_matches(&re->prog, in, ch) && dfa_closure(re, dd, in->next1, 0) && !dd->keep_finals) {
+            d->next[ch] = DFA_MATCH;
+            return DFA_MATCH;
+        }
+    }
+
+    // Every offset gets a go, start_ids is empty if the pattern started with '^'
+    for (int i = 0; i < dd->n_start_ids; i++) {
+        int id = dd->start_ids[i];
+        if (dd->marks[id] == dd->gen)
+            continue;
+        dd->marks[id] = dd->gen;
+        dd->dense[dd->n++] = id;
+    }
+
+    DfaState *nd = dfa_find_state(re, dd);
+    if (nd != NULL)
+        d->next[ch] = nd;
+
+    return nd;
+}
+
+/**
+ * Finds the DFA state for the set of ids in dd->dense, making it if it doesn't exist yet
+ * Returns NULL if making it would go over the memory limit
+ */
+static DfaState *dfa_find_state(Regex *re, DfaData *dd) {
+    qsort(dd->dense, dd->n, sizeof(int), compare_ids);
+
+    // FNV-1a over the ids
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < dd->n; i++) {
+        hash ^= (unsigned int) dd->dense[i];
+        hash *= 16777619u;
+    }
+
+    DfaState *d = dd->table[hash % DFA_HASH_SIZE];
+    for (; d != NULL; d = d->hash_next) {
+        if (d->hash == hash && d->n == dd->n && !memcmp(d->ids, dd->dense, sizeof(int) * dd->n))
+            return d;
+    }
+
+    size_t size = sizeof(DfaState) + sizeof(int) * dd->n;
+    if (dd->mem_used + size > re->dfa_mem_limit)
+        return NULL;
+
+    d = calloc(1, size);
+    d->hash = hash;
+    d->n = dd->n;
+    memcpy(d->ids, dd->dense, sizeof(int) * dd->n);
+
+    for (int i = 0; i < d->n && dd->keep_finals; i++)
+        if (re->prog.insts[d->ids[i]].op == OP_MATCH)
+            d->accepts = 1;
+
+    d->hash_next = dd->table[hash % DFA_HASH_SIZE];
+    dd->table[hash % DFA_HASH_SIZE] = d;
+    dd->mem_used += size;
+    dd->n_dfa_states++;
+
+    return d;
+}
+
+/**
+ * Adds the states that consume input reachable from s to the set in dd->dense
+ * Returns 1 if S_FINAL can be reached
+ * With stop_at_final the states are followed in priority order and we stop at S_FINAL,
+ * which is what happens to a brand new thread in the pike VM
+ */
+static int dfa_closure(Regex *re, DfaData *dd, uint32_t pc, int stop_at_final) {
+    const Inst *insts = re->prog.insts;
+    uint32_t *sp = dd->stack;
+    int found_final = 0;
+    *sp++ = pc;
+
+    while (sp != dd->stack) {
+        pc = *--sp;
+        const Inst *in = &insts[pc];
+
+        if (in->op == OP_MATCH) {
+            found_final = 1;
+            if (stop_at_final)
+                return 1;
+
+            // Sets need to know which pattern it was
+            if (dd->keep_finals && dd->marks[pc] != dd->gen) {
+                dd->marks[pc] = dd->gen;
+                dd->dense[dd->n++] = pc;
+            }
+            continue;
+        }
+
+        if (dd->marks[pc] == dd->gen)
+            continue;
+        dd->marks[pc] = dd->gen;
+
+        switch (in->op) {
+            case OP_SPLIT:
+                if (in->next2 != NO_INST)
+                    *sp++ = in->next2;
+                *sp++ = in->next1;
+                break;
+
+            case OP_GROUP_START:
+            case OP_GROUP_END:
+                *sp++ = in->next1;
+                break;
+
+            default: // Consumes input
+                dd->dense[dd->n++] = pc;
+                break;
+        }
+    }
+
+    return found_final;
+}
+
+static int dfa_step_matches(const Program *prog, const Inst *in, unsigned char ch) {
+    switch (in->op) {
+        case OP_CHAR:          return in->ch == ch;
+        case OP_ANY:           return 1;
+        case OP_CLASS:         return cclass_has(&prog->classes[in->arg], ch);
+        default:               return 0;
+    }
+}
+
+static int compare_ids(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+// Cached transitions are only counted in a local while the DFA runs, this adds them to the stats
+static void dfa_stats(DfaData *dd, unsigned long long hits) {
+    RegexStats *st = match_stats;
+    if (st == NULL)
+        return;
+
+    st->states += hits;
+    st->dfa_hits += hits;
+    st->dfa_memory = dd->mem_used;
+}
@@ -0,0 +1,168 @@
+/**
+ * Tidying up the state machine once the parser is done with it.
+ *
+ * The parser builds everything out of small fragments glued together, which leaves a lot of
+ * states that don't do anything. Every call to parse_pattern starts with an S_NODE that only
+ * goes one way, and so does every '|' that ends a pattern. Those just get pointed past, so
+ * nothing ever has to step through them.
+ *
+ * For patterns only the backtracker runs, strings of literal characters get joined into one
+ * S_LITERAL_STR state that matches them all with a memcmp. The pike VM and the DFA move one
+ * byte at a time so anything they run keeps the single character states.
+ *
+ * Afterwards the states nothing can get to any more are left out of re->states and the rest
+ * are numbered again, so the engines that size things by n_states don't pay for them
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Function Prototypes *****/
+void optimize_states(Regex *re, int fuse);
+
+static State *skip_nodes(State *s, int n_states);
+static void skip_empty_nodes(Regex *re);
+static void fuse_literals(Regex *re);
+static void number_states(Regex *re);
+
+
+
+/**
+ * Runs after the whole machine is built, before anything else looks at it
+ * fuse is set when only the backtracker is ever going to run it
+ */
+void optimize_states(Regex *re, int fuse) {
+    int before = re->n_states;
+
+    skip_empty_nodes(re);
+    number_states(re);
+
+    if (fuse) {
+        fuse_literals(re);
+        number_states(re);
+    }
+
+    regex_log("Optimized %d states down to %d\n", before, re->n_states);
+    (void) before;
+}
+
+// An S_NODE with nowhere else to go is the same as where it goes
+static State *skip_nodes(State *s, int n_states) {
+    // Bounded in case some daft pattern ends up going round in a loop of them
+    for (int i = 0; s != NULL && s->type == S_NODE && s->next2 == NULL && i < n_states; i++)
+        s = s->next1;
+
+    return s;
+}
+
+static void skip_empty_nodes(Regex *re) {
+    for (int i = 0; i < re->n_states; i++) {
+        State *s = re->states[i];
+        s->next1 = skip_nodes(s->next1, re->n_states);
+        s->next2 = skip_nodes(s->next2, re->n_states);
+    }
+
+    re->start = skip_nodes(re->start, re->n_states);
+    for (int i = 0; i < re->n_set; i++)
+        re->set[i].start = skip_nodes(re->set[i].start, re->n_states);
+}
+
+/**
+ * A literal whose only way in is from the literal before it gets joined onto that one
+ * number_states leaves them in the order they're first found from the start, and nothing can
+ * get to the middle of a run without going through the start of it, so the start always
+ * comes first and picks up the whole thing
+ */
+static void fuse_literals(Regex *re) {
+    int *refs = calloc(re->n_states, sizeof(int));
+    unsigned char *buf = malloc(re->n_states);
+
+    for (int i = 0; i < re->n_states; i++) {
+        State *s = re->states[i];
+        if (s->next1)
+            refs[s->next1->id]++;
+        if (s->next2)
+            refs[s->next2->id]++;
+    }
+    refs[re->start->id]++;
+
+    for (int i = 0; i < re->n_states; i++) {
+        State *s = re->states[i];
+        // Already part of a run, -1 so it doesn't start one of its own
+        if (s->type != S_LITERAL_CH || s->next2 != NULL || refs[s->id] < 0)
+            continue;
+
+        int n = 0;
+        State *end = s;
+        buf[n++] = s->data.ch;
+
+        // Capped so the length fits in an Inst, anything longer carries on in another run
+        while (end->next1 != NULL && end->next1 != s && end->next1->type == S_LITERAL_CH
+                && end->next1->next2 == NULL && refs[end->next1->id] == 1 && n < UINT16_MAX) {
+            end = end->next1;
+            buf[n++] = end->data.ch;
+            refs[end->id] = -1;
+        }
+
+        if (n == 1)
+            continue;
+
+        unsigned char *str = arena_alloc(re, n);
+        memcpy(str, buf, n);
+
+        s->type = S_LITERAL_STR;
+        s->data.lit.str = str;
+        s->data.lit.len = n;
+        s->next1 = end->next1;
+        regex_log("Joined %d literals into state %d\n", n, s->id);
+    }
+
+    free(refs);
+    free(buf);
+}
+
+// Keeps only the states that can be got to from the start, numbered in the order they're found
+static void number_states(Regex *re) {
+    int n_old = re->n_states;
+    char *seen = calloc(n_old, sizeof(char));
+    State **states = malloc(sizeof(State *) * re->states_size);
+    State **stack = malloc(sizeof(State *) * (2 * n_old + 1 + re->n_set));
+    State **sp = stack;
+    int n = 0;
+
+    // Set patterns are pushed too, they're all reachable from the root anyway
+    for (int i = re->n_set - 1; i >= 0; i--)
+        *sp++ = re->set[i].start;
+    *sp++ = re->start;
+
+    while (sp != stack) {
+        State *s = *--sp;
+        if (seen[s->id])
+            continue;
+        seen[s->id] = 1;
+        states[n++] = s;
+
+        // next1 goes on last so it's the one looked at next
+        if (s->next2)
+            *sp++ = s->next2;
+        if (s->next1)
+            *sp++ = s->next1;
+    }
+
+    for (int i = 0; i < n; i++)
+        states[i]->id = i;
+
+    free(re->states);
+    re->states = states;
+    re->n_states = n;
+
+    free(seen);
+    free(stack);
+}
@@ -0,0 +1,301 @@
+/**
+ * Parallel matching - splits one big buffer between threads for regex_match_parallel.
+ *
+ * The trouble with cutting the input up is that a chunk doesn't know what state the DFA is in
+ * when it starts, that depends on everything before it. So every chunk guesses that nothing is
+ * in progress (the DFA's start state) and gets run on its own thread from there.
+ *
+ * The real state at the start of a chunk is always the start state plus whatever was left
+ * over from earlier chunks, and running a set of states is the same as running each of them
+ * on their own and putting the results together. So once the threads are done the chunks get
+ * stitched together in order:
+ *  - A chunk that matched from the guess matches for real too, since the real state only has more in it
+ *  - The leftovers coming into a chunk get run through it with nothing new starting. They
+ *    normally die off after a few bytes so this part is cheap
+ *  - The state at the end of a chunk is where the guess ended up plus where the leftovers did
+ * Which gives exactly the same answer as going through the whole buffer in one go
+ *
+ * Batches are easier, every input starts from the start anyway so threads just take
+ * PARALLEL_BATCH_SIZE of them at a time until there aren't any left
+ */
+
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Datatypes *****/
+typedef struct ParallelChunk_ {
+    const char *string;
+    int len;
+
+    int matched;
+    int *end_ids; // The states it finished in
+    int n_end;
+} ParallelChunk;
+
+typedef struct Parallel_ {
+    Regex *re;
+    struct ParallelChunk_ *chunks;
+    int n_chunks;
+    int next_chunk;
+    int found; // Something matched so nobody else needs to bother
+
+    // What the other threads counted, only if the thread that called wants stats
+    struct RegexStats_ stats;
+    int collect;
+} Parallel;
+
+typedef struct ParallelBatch_ {
+    Regex *re;
+    const RegexInput *inputs;
+    int n;
+    int *results;
+    int next; // The first input nobody has taken yet
+
+    struct RegexStats_ stats;
+    int collect;
+} ParallelBatch;
+
+
+
+/***** Function Prototypes *****/
+int parallel_exec(Regex *re, const char *string, size_t len, int n_threads);
+void parallel_batch(Regex *re, const RegexInput *inputs, int n, int *results, int n_threads);
+
+static void *parallel_thread(void *arg);
+static void parallel_work(Parallel *p, struct DfaData_ *dd);
+static int parallel_stitch(Parallel *p, const int *start_ids, int n_start);
+static void *parallel_batch_thread(void *arg);
+static void parallel_batch_work(ParallelBatch *b, struct DfaData_ *dd);
+
+
+
+// Returns 1 if string has a (non-empty) match, splitting the work between n_threads threads
+int parallel_exec(Regex *re, const char *string, size_t len, int n_threads) {
+    if (n_threads < 1)
+        n_threads = 1;
+
+    size_t chunk_len = (len + n_threads - 1) / n_threads;
+    if (chunk_len < PARALLEL_MIN_CHUNK)
+        chunk_len = PARALLEL_MIN_CHUNK;
+    if (chunk_len > PARALLEL_MAX_CHUNK)
+        chunk_len = PARALLEL_MAX_CHUNK;
+
+    // Not worth splitting up
+    if (len <= chunk_len)
+        return dfa_exec(re, string, (int) len);
+
+    Parallel p;
+    p.re = re;
+    p.n_chunks = (int) ((len + chunk_len - 1) / chunk_len);
+    p.chunks = malloc(sizeof(ParallelChunk) * p.n_chunks);
+    p.next_chunk = 0;
+    p.found = 0;
+    memset(&p.stats, 0, sizeof(RegexStats));
+    p.collect = (match_stats != NULL);
+
+    for (int i = 0; i < p.n_chunks; i++) {
+        size_t start = i * chunk_len;
+        p.chunks[i].string = string + start;
+        p.chunks[i].len = (int) (len - start < chunk_len ? len - start : chunk_len);
+        p.chunks[i].matched = 0;
+        p.chunks[i].end_ids = malloc(sizeof(int) * re->n_states);
+        p.chunks[i].n_end = 0;
+    }
+
+    regex_log("Matching %zu bytes in %d chunks\n", len, p.n_chunks);
+
+    // This thread does its share too
+    int n_spawn = (n_threads < p.n_chunks ? n_threads : p.n_chunks) - 1;
+    pthread_t *threads = malloc(sizeof(pthread_t) * (n_spawn + 1));
+    int n_started = 0;
+
+    for (; n_started < n_spawn; n_started++)
+        if (pthread_create(&threads[n_started], NULL, parallel_thread, &p) != 0)
+            break; // The ones we did get will pick up the slack
+
+    struct DfaData_ *dd = dfa_create(re, 1);
+    const int *start_ids;
+    int n_start = dfa_start_ids(dd, &start_ids);
+    parallel_work(&p, dd);
+
+    for (int i = 0; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+
+    int matched = p.found || parallel_stitch(&p, start_ids, n_start);
+    if (p.collect)
+        stats_merge(match_stats, &p.stats);
+
+    dfa_destroy(dd);
+    for (int i = 0; i < p.n_chunks; i++)
+        free(p.chunks[i].end_ids);
+    free(p.chunks);
+    free(threads);
+
+    return matched;
+}
+
+static void *parallel_thread(void *arg) {
+    Parallel *p = arg;
+    struct DfaData_ *dd = dfa_create(p->re, 1);
+    RegexStats stats;
+
+    if (p->collect)
+        regex_stats_start(&stats);
+
+    parallel_work(p, dd);
+
+    if (p->collect) {
+        stats_merge(&p->stats, &stats);
+        regex_stats_stop();
+    }
+
+    dfa_destroy(dd);
+    return NULL;
+}
+
+// Takes chunks until there aren't any left. Every thread has a DFA of its own, they can't share the cache
+static void parallel_work(Parallel *p, struct DfaData_ *dd) {
+    const int *start_ids;
+    int n_start = dfa_start_ids(dd, &start_ids);
+
+    while (!__atomic_load_n(&p->found, __ATOMIC_RELAXED)) {
+        int i = __atomic_fetch_add(&p->next_chunk, 1, __ATOMIC_RELAXED);
+        if (i >= p->n_chunks)
+            break;
+
+        // The first chunk is the only one that knows where it really starts
+        ParallelChunk *c = &p->chunks[i];
+        c->matched = dfa_exec_chunk(p->re, dd, (i == 0) ? NULL : start_ids, n_start,
+                c->string, c->len, c->end_ids, &c->n_end);
+
+        if (c->matched)
+            __atomic_store_n(&p->found, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Goes through the chunks in order running whatever the guesses missed, see the top of the file
+static int parallel_stitch(Parallel *p, const int *start_ids, int n_start) {
+    Regex *re = p->re;
+    struct DfaData_ *leftovers = dfa_create(re, 0);
+    char *in_start = calloc(re->n_states, sizeof(char));
+    char *seen = calloc(re->n_states, sizeof(char));
+    int *cur = malloc(sizeof(int) * re->n_states);
+    int *left = malloc(sizeof(int) * re->n_states);
+    int *left_end = malloc(sizeof(int) * re->n_states);
+    int n_cur = p->chunks[0].n_end;
+    int matched = 0;
+
+    for (int i = 0; i < n_start; i++)
+        in_start[start_ids[i]] = 1;
+    memcpy(cur, p->chunks[0].end_ids, sizeof(int) * n_cur);
+
+    for (int k = 1; k < p->n_chunks && !matched; k++) {
+        ParallelChunk *c = &p->chunks[k];
+        int n_left = 0;
+        int n_left_end = 0;
+
+        // The start states are what the guess began with, everything else is left over
+        for (int i = 0; i < n_cur; i++)
+            if (!in_start[cur[i]])
+                left[n_left++] = cur[i];
+
+        if (n_left > 0) {
+            regex_log("%d states left over going into chunk %d\n", n_left, k);
+            matched = dfa_exec_chunk(re, leftovers, left, n_left, c->string, c->len, left_end, &n_left_end);
+        }
+
+        // Where the guess ended up plus where the leftovers did
+        n_cur = 0;
+        for (int i = 0; i < c->n_end; i++) {
+            seen[c->end_ids[i]] = 1;
+            cur[n_cur++] = c->end_ids[i];
+        }
+        for (int i = 0; i < n_left_end; i++) {
+            if (!seen[left_end[i]])
+                cur[n_cur++] = left_end[i];
+        }
+        for (int i = 0; i < c->n_end; i++)
+            seen[c->end_ids[i]] = 0;
+    }
+
+    dfa_destroy(leftovers);
+    free(in_start);
+    free(seen);
+    free(cur);
+    free(left);
+    free(left_end);
+
+    return matched;
+}
+
+// Shares the inputs out between n_threads threads, this thread uses the Regex's own DFA so it stays warm between calls
+void parallel_batch(Regex *re, const RegexInput *inputs, int n, int *results, int n_threads) {
+    ParallelBatch b;
+    b.re = re;
+    b.inputs = inputs;
+    b.n = n;
+    b.results = results;
+    b.next = 0;
+    memset(&b.stats, 0, sizeof(RegexStats));
+    b.collect = (match_stats != NULL);
+
+    int n_spawn = (n + PARALLEL_BATCH_SIZE - 1) / PARALLEL_BATCH_SIZE - 1;
+    if (n_spawn > n_threads - 1)
+        n_spawn = n_threads - 1;
+    if (n_spawn < 0)
+        n_spawn = 0;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (n_spawn + 1));
+    int n_started = 0;
+
+    for (; n_started < n_spawn; n_started++)
+        if (pthread_create(&threads[n_started], NULL, parallel_batch_thread, &b) != 0)
+            break;
+
+    parallel_batch_work(&b, NULL);
+
+    for (int i = 0; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (b.collect)
+        stats_merge(match_stats, &b.stats);
+}
+
+static void *parallel_batch_thread(void *arg) {
+    ParallelBatch *b = arg;
+    struct DfaData_ *dd = dfa_create(b->re, 1);
+    RegexStats stats;
+
+    if (b->collect)
+        regex_stats_start(&stats);
+
+    parallel_batch_work(b, dd);
+
+    if (b->collect) {
+        stats_merge(&b->stats, &stats);
+        regex_stats_stop();
+    }
+
+    dfa_destroy(dd);
+    return NULL;
+}
+
+static void parallel_batch_work(ParallelBatch *b, struct DfaData_ *dd) {
+    while (1) {
+        int i = __atomic_fetch_add(&b->next, PARALLEL_BATCH_SIZE, __ATOMIC_RELAXED);
+        if (i >= b->n)
+            break;
+
+        int n = (b->n - i < PARALLEL_BATCH_SIZE) ? b->n - i : PARALLEL_BATCH_SIZE;
+        dfa_exec_batch(b->re, dd, b->inputs + i, n, b->results + i);
+    }
+}
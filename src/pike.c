@@ -0,0 +1,515 @@
+/**
+ * Pike VM - runs every possible path through the state machine at the same time
+ * instead of trying them one after another like perform_regex does.
+ *
+ * Each thread is a state plus the capture offsets it has collected so far. Threads are kept
+ * in priority order (next1 before next2, earlier starts before later ones) so we get the
+ * same leftmost-first answer as the backtracker, but a state can only ever hold one thread
+ * per input position so the work is O(states * input) no matter what the pattern looks like.
+ *
+ * Doesn't handle back references or arbitrary quantifiers since those need to know
+ * what happened earlier in the match, regex_exec sends those to the backtracker instead.
+ *
+ * Since it only ever looks at one character at a time it's also what RegexStream uses.
+ * The stream keeps its own threads between chunks. Matches are only reported as offsets, so
+ * the only input it holds on to is what it might have to look at again, from the end of a
+ * match it's waiting to report since that's where it carries on looking.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Datatypes *****/
+typedef struct PikeThread_ {
+    uint32_t pc;
+    int *caps;
+} PikeThread;
+
+// Sparse set of threads, so adding and checking for a state are both O(1) and clearing is free
+typedef struct PikeList_ {
+    int *sparse; // instruction -> index into dense
+    PikeThread *dense;
+    int n;
+
+    int *caps; // n_slots ints per instruction
+} PikeList;
+
+// Epsilon states get followed with an explicit stack so a big pattern can't blow the C stack
+typedef struct PikeJob_ {
+    uint32_t pc;
+    int slot; // if pc is NO_INST this job restores caps[slot] to old
+    int old;
+} PikeJob;
+
+typedef struct PikeData_ {
+    const Program *prog;
+    PikeList lists[2];
+    PikeJob *jobs;
+    int *caps; // Working copy of the captures while following epsilons
+    int n_slots;
+} PikeData;
+
+/**
+ * Every offset in here is relative to base, which only moves up to the earliest offset any
+ * thread or match still has. buf holds the input from buf_start, nothing before that gets
+ * looked at again. The chunk being worked on carries on straight after the end of buf
+ */
+struct RegexStream_ {
+    Regex *re;
+    PikeData *pd;
+    PikeList *clist;
+    PikeList *nlist;
+
+    int pos;     // Next offset to look at
+    int matched; // match holds the best match so far, but higher priority threads are still going
+    int *match;
+    int done;    // Nothing else can match, either the input ended or an anchored pattern is past offset 0
+
+    long long base;
+    char *buf; // NULL until something needs keeping
+    int buf_start;
+    int buf_len;
+    int buf_size;
+
+    RegexStreamFn fn;
+    void *data;
+    long long *caps; // What gets handed to fn
+};
+
+
+
+/***** Function Prototypes *****/
+int pike_exec(Regex *re, const char *string, int len, int *caps);
+void pike_free(PikeData *pd);
+
+static PikeData *create_pike_data(Regex *re);
+static void add_thread(PikeData *pd, PikeList *l, uint32_t pc, int pos);
+static int pike_step_matches(const Program *prog, const Inst *in, char ch);
+static void stream_run(RegexStream *st, const char *chunk, int chunk_len, int at_end);
+static void stream_report(RegexStream *st);
+static void stream_keep(RegexStream *st, const char *chunk, int chunk_len);
+static int stream_thread_has_caps(const Program *prog, PikeThread *t);
+
+
+
+/**
+ * Fills caps with the offsets of the match and its capture groups, -1 if a group didn't match
+ * Returns 1 if there was a match
+ *
+ * Empty matches are thrown away the same way regex_exec throws them away for the backtracker,
+ * so an empty match at one offset lets the next offset have a go
+ */
+int pike_exec(Regex *re, const char *string, int len, int *caps) {
+    Scratch *sc = regex_scratch(re);
+    if (sc->pike == NULL)
+        sc->pike = create_pike_data(re);
+
+    PikeData *pd = sc->pike;
+    const Inst *insts = re->prog.insts;
+    PikeList *clist = &pd->lists[0];
+    PikeList *nlist = &pd->lists[1];
+    PikeList *tmp;
+    int matched = 0;
+    unsigned long long states = 0;
+    int starts = 0;
+
+    clist->n = 0;
+    nlist->n = 0;
+
+    for (int pos = 0; pos <= len; pos++) {
+        // Nothing running so we can skip to wherever the next match could start
+        if (clist->n == 0 && !matched && !re->options.start_of_string)
+            pos = scan_first(re, string, pos, len);
+
+        // A new thread for a match starting here. It goes in last since it has the lowest priority
+        if (!matched && pos < len && (pos == 0 || !re->options.start_of_string)) {
+            for (int i = 0; i < pd->n_slots; i++)
+                pd->caps[i] = -1;
+            pd->caps[0] = pos;
+            add_thread(pd, clist, re->start->id, pos);
+            regex_trace(REGEX_TRACE_START, 0, pos);
+            starts++;
+        }
+
+        if (clist->n == 0) {
+            if (matched || re->options.start_of_string)
+                break;
+            continue;
+        }
+
+        states += clist->n;
+        for (int i = 0; i < clist->n; i++) {
+            PikeThread *t = &clist->dense[i];
+            const Inst *in = &insts[t->pc];
+            regex_trace(REGEX_TRACE_STEP, t->pc, pos);
+
+            if (in->op == OP_MATCH) {
+                // An empty match counts as a failure for that start, but it still beats
+                // everything below it so we cut those threads either way
+                if (t->caps[0] != pos) {
+                    memcpy(caps, t->caps, sizeof(int) * pd->n_slots);
+                    caps[1] = pos;
+                    matched = 1;
+                    regex_trace(REGEX_TRACE_MATCH, t->pc, pos);
+                }
+                break;
+            }
+
+            if (pos < len && pike_step_matches(&re->prog, in, string[pos])) {
+                memcpy(pd->caps, t->caps, sizeof(int) * pd->n_slots);
+                add_thread(pd, nlist, in->next1, pos + 1);
+            }
+        }
+
+        tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+        nlist->n = 0;
+    }
+
+    if (matched)
+        regex_log("Pike VM matched from %d to %d\n", caps[0], caps[1]);
+    else
+        regex_log("Pike VM found no match\n");
+
+    if (match_stats != NULL) {
+        match_stats->states += states;
+        match_stats->starts += starts;
+    }
+
+    return matched;
+}
+
+void pike_free(PikeData *pd) {
+    if (pd == NULL)
+        return;
+
+    for (int i = 0; i < 2; i++) {
+        free(pd->lists[i].sparse);
+        free(pd->lists[i].dense);
+        free(pd->lists[i].caps);
+    }
+    free(pd->jobs);
+    free(pd->caps);
+    free(pd);
+}
+
+static PikeData *create_pike_data(Regex *re) {
+    PikeData *pd = malloc(sizeof(PikeData));
+    pd->prog = &re->prog;
+    pd->n_slots = 2 * (re->n_groups + 1);
+
+    for (int i = 0; i < 2; i++) {
+        // sparse doesn't need clearing, the dense check catches any garbage in it
+        pd->lists[i].sparse = malloc(sizeof(int) * re->n_states);
+        pd->lists[i].dense = malloc(sizeof(PikeThread) * re->n_states);
+        pd->lists[i].caps = malloc(sizeof(int) * pd->n_slots * re->n_states);
+        pd->lists[i].n = 0;
+    }
+
+    // Every state gets followed at most once and pushes at most two jobs when it is
+    pd->jobs = malloc(sizeof(PikeJob) * (3 * re->n_states + 1));
+    pd->caps = malloc(sizeof(int) * pd->n_slots);
+
+    return pd;
+}
+
+/**
+ * Follows s through any epsilon states and adds the states that end up consuming
+ * input (or finishing the match) to l, using the captures in pd->caps
+ */
+static void add_thread(PikeData *pd, PikeList *l, uint32_t pc, int pos) {
+    const Inst *insts = pd->prog->insts;
+    PikeJob *jp = pd->jobs;
+    *jp++ = (PikeJob) {pc, 0, 0};
+
+    while (jp != pd->jobs) {
+        PikeJob j = *--jp;
+
+        if (j.pc == NO_INST) {
+            pd->caps[j.slot] = j.old;
+            continue;
+        }
+
+        pc = j.pc;
+        int i = l->sparse[pc];
+        if ((unsigned int) i < (unsigned int) l->n && l->dense[i].pc == pc)
+            continue; // Something with a higher priority already got here
+
+        i = l->n++;
+        l->sparse[pc] = i;
+        l->dense[i].pc = pc;
+        l->dense[i].caps = &l->caps[pc * pd->n_slots];
+
+        const Inst *in = &insts[pc];
+        switch (in->op) {
+            case OP_SPLIT:
+                // Pushed backwards so next1 comes off the stack first
+                if (in->next2 != NO_INST)
+                    *jp++ = (PikeJob) {in->next2, 0, 0};
+                *jp++ = (PikeJob) {in->next1, 0, 0};
+                break;
+
+            case OP_GROUP_START:
+            case OP_GROUP_END: ;
+                // Same as the backtracker, a group only captures the first time through
+                int slot = 2 * in->arg + (in->op == OP_GROUP_END);
+                if (pd->caps[slot] == -1) {
+                    *jp++ = (PikeJob) {NO_INST, slot, -1};
+                    pd->caps[slot] = pos;
+                }
+                *jp++ = (PikeJob) {in->next1, 0, 0};
+                break;
+
+            default: // Anything that consumes a character, and S_FINAL
+                memcpy(l->dense[i].caps, pd->caps, sizeof(int) * pd->n_slots);
+                break;
+        }
+    }
+}
+
+// Returns 1 if the instruction can consume ch
+static int pike_step_matches(const Program *prog, const Inst *in, char ch) {
+    switch (in->op) {
+        case OP_CHAR:          return in->ch == (unsigned char) ch;
+        case OP_ANY:           return 1;
+        case OP_CLASS:         return cclass_has(&prog->classes[in->arg], ch);
+        default:               return 0;
+    }
+}
+
+
+
+/***** Streaming *****/
+RegexStream *regex_stream_open(Regex *re, RegexStreamFn fn, void *data) {
+    // The backtracker needs all the input at once to go back over
+    if (re->needs_backtrack || re->options.backtrack)
+        return NULL;
+
+    RegexStream *st = malloc(sizeof(RegexStream));
+    st->re = re;
+    st->pd = create_pike_data(re);
+    st->clist = &st->pd->lists[0];
+    st->nlist = &st->pd->lists[1];
+    st->clist->n = 0;
+    st->nlist->n = 0;
+
+    st->pos = 0;
+    st->matched = 0;
+    st->match = malloc(sizeof(int) * st->pd->n_slots);
+    st->done = 0;
+
+    st->base = 0;
+    st->buf = NULL;
+    st->buf_start = 0;
+    st->buf_len = 0;
+    st->buf_size = 0;
+
+    st->fn = fn;
+    st->data = data;
+    st->caps = malloc(sizeof(long long) * st->pd->n_slots);
+
+    return st;
+}
+
+void regex_stream_feed(RegexStream *st, const char *chunk, size_t len) {
+    stats_input(len);
+    stream_run(st, chunk, (int) len, 0);
+    stream_keep(st, chunk, (int) len);
+}
+
+size_t regex_stream_buffered(const RegexStream *st) {
+    return (size_t) st->buf_size;
+}
+
+void regex_stream_end(RegexStream *st) {
+    stream_run(st, "", 0, 1);
+    st->done = 1;
+    st->buf_len = 0;
+}
+
+void regex_stream_free(RegexStream *st) {
+    if (st == NULL)
+        return;
+
+    pike_free(st->pd);
+    free(st->match);
+    free(st->buf);
+    free(st->caps);
+    free(st);
+}
+
+/**
+ * Same as the loop in pike_exec, but the input is whatever's left in buf followed by chunk
+ * Without at_end we stop when we run out of input and pick up from there next time
+ */
+static void stream_run(RegexStream *st, const char *chunk, int chunk_len, int at_end) {
+    Regex *re = st->re;
+    PikeData *pd = st->pd;
+    PikeList *tmp;
+    int buf_end = st->buf_start + st->buf_len;
+    int len = buf_end + chunk_len;
+    unsigned long long states = 0;
+    int starts = 0;
+
+    while (1) {
+        // Nothing higher priority is left so the match can't change any more
+        if (st->matched && st->clist->n == 0)
+            stream_report(st);
+
+        if (st->pos > len || (st->pos == len && !at_end))
+            break;
+
+        if (st->clist->n == 0 && !st->matched) {
+            // An anchored pattern only gets a go at the very start
+            if (re->options.start_of_string && st->base + st->pos > 0)
+                st->done = 1;
+
+            if (st->done) {
+                st->pos = len + 1;
+                break;
+            }
+
+            // Nothing running so we can skip to wherever the next match could start
+            if (st->pos >= buf_end && st->pos < len)
+                st->pos = buf_end + scan_first(re, chunk, st->pos - buf_end, chunk_len);
+
+            if (st->pos == len && !at_end)
+                break;
+        }
+
+        int pos = st->pos;
+        int have_ch = pos < len;
+        char ch = !have_ch ? '\0' : (pos < buf_end) ? st->buf[pos - st->buf_start] : chunk[pos - buf_end];
+
+        // A new thread for a match starting here. It goes in last since it has the lowest priority
+        if (!st->matched && have_ch && !st->done && (st->base + pos == 0 || !re->options.start_of_string)) {
+            for (int i = 0; i < pd->n_slots; i++)
+                pd->caps[i] = -1;
+            pd->caps[0] = pos;
+            add_thread(pd, st->clist, re->start->id, pos);
+            regex_trace(REGEX_TRACE_START, 0, pos);
+            starts++;
+        }
+
+        states += st->clist->n;
+        for (int i = 0; i < st->clist->n; i++) {
+            PikeThread *t = &st->clist->dense[i];
+            const Inst *in = &re->prog.insts[t->pc];
+            regex_trace(REGEX_TRACE_STEP, t->pc, pos);
+
+            if (in->op == OP_MATCH) {
+                if (t->caps[0] != pos) {
+                    memcpy(st->match, t->caps, sizeof(int) * pd->n_slots);
+                    st->match[1] = pos;
+                    st->matched = 1;
+                    regex_trace(REGEX_TRACE_MATCH, t->pc, pos);
+                }
+                break;
+            }
+
+            if (have_ch && pike_step_matches(&re->prog, in, ch)) {
+                memcpy(pd->caps, t->caps, sizeof(int) * pd->n_slots);
+                add_thread(pd, st->nlist, in->next1, pos + 1);
+            }
+        }
+
+        tmp = st->clist;
+        st->clist = st->nlist;
+        st->nlist = tmp;
+        st->nlist->n = 0;
+        st->pos++;
+    }
+
+    if (match_stats != NULL) {
+        match_stats->states += states;
+        match_stats->starts += starts;
+    }
+}
+
+// Hands the match to the callback and starts looking again from the end of it
+static void stream_report(RegexStream *st) {
+    for (int i = 0; i < st->pd->n_slots; i++)
+        st->caps[i] = (st->match[i] == -1) ? -1 : st->base + st->match[i];
+
+    regex_log("Stream matched from %lld to %lld\n", st->caps[0], st->caps[1]);
+    st->fn(st->caps, st->re->n_groups, st->data);
+
+    st->pos = st->match[1];
+    st->matched = 0;
+    st->clist->n = 0;
+    st->nlist->n = 0;
+}
+
+/**
+ * Keeps the input from where we're up to, or from the end of the match we're holding on to since
+ * that's where looking starts again once it's reported. A thread that started a long time ago
+ * doesn't need its input kept, only its offsets, so those get moved down to the earliest one
+ * anything still has and become the new base
+ */
+static void stream_keep(RegexStream *st, const char *chunk, int chunk_len) {
+    int buf_end = st->buf_start + st->buf_len;
+    int len = buf_end + chunk_len;
+    int keep = (st->pos < len) ? st->pos : len;
+
+    if (st->matched && st->match[1] < keep)
+        keep = st->match[1];
+
+    int n = len - keep;
+    if (n > st->buf_size) {
+        int size = (st->buf_size > 0) ? st->buf_size : STREAM_MIN_BUFFER;
+        while (n > size)
+            size *= 2;
+        char *new_buf = malloc(size);
+        if (keep < buf_end)
+            memcpy(new_buf, st->buf + (keep - st->buf_start), buf_end - keep);
+        free(st->buf);
+        st->buf = new_buf;
+        st->buf_size = size;
+    } else if (keep < buf_end) {
+        memmove(st->buf, st->buf + (keep - st->buf_start), buf_end - keep);
+    }
+
+    // Then whatever we need out of chunk
+    int from_buf = (keep < buf_end) ? buf_end - keep : 0;
+    int chunk_start = (keep > buf_end) ? keep - buf_end : 0;
+    if (chunk_len > chunk_start)
+        memcpy(st->buf + from_buf, chunk + chunk_start, chunk_len - chunk_start);
+    st->buf_start = keep;
+    st->buf_len = n;
+
+    int origin = keep;
+    if (st->matched && st->match[0] < origin)
+        origin = st->match[0];
+    for (int i = 0; i < st->clist->n; i++)
+        if (stream_thread_has_caps(&st->re->prog, &st->clist->dense[i]) && st->clist->dense[i].caps[0] < origin)
+            origin = st->clist->dense[i].caps[0];
+
+    // Moving every offset we're holding on to down by the same amount
+    for (int i = 0; i < st->clist->n; i++)
+        for (int j = 0; j < st->pd->n_slots && stream_thread_has_caps(&st->re->prog, &st->clist->dense[i]); j++)
+            if (st->clist->dense[i].caps[j] != -1)
+                st->clist->dense[i].caps[j] -= origin;
+
+    if (st->matched)
+        for (int j = 0; j < st->pd->n_slots; j++)
+            if (st->match[j] != -1)
+                st->match[j] -= origin;
+
+    st->pos -= origin;
+    st->buf_start -= origin;
+    st->base += origin;
+}
+
+// The epsilon states are only in the list so they don't get followed twice, their captures are never filled in
+static int stream_thread_has_caps(const Program *prog, PikeThread *t) {
+    uint8_t op = prog->insts[t->pc].op;
+    return op != OP_SPLIT && op != OP_GROUP_START && op != OP_GROUP_END;
+}
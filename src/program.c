@@ -0,0 +1,321 @@
+/**
+ * Program - the finished state machine flattened into an array of instructions.
+ *
+ * The parser and optimize.c work on States, which are separate bits of the arena joined up by
+ * pointers. That's easy to build and rewrite, but matching with it means following pointers
+ * from one State to the next and reading a union to find out what each one wants.
+ *
+ * Once the machine won't change any more it gets written out as one block: the instructions,
+ * followed by the character classes, the counting loops and the bytes of the literal runs.
+ * Everything is referred to by a 32 bit index instead of a pointer, and since the states are
+ * already numbered in the order they're reached from the start, what follows an instruction
+ * is usually the next one along. This is what every engine runs. The States stay around for
+ * the compile time passes (scan_compile) and for regex_trace_print to describe
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Function Prototypes *****/
+void program_compile(Regex *re);
+
+static uint32_t inst_index(const State *s);
+static void find_cycles(Program *p);
+static uint32_t empty_next(const Program *p, uint32_t i, int which);
+static void find_loop_bodies(Program *p);
+
+
+
+// Builds re->prog from re->states, which have to be numbered already (see number_states)
+void program_compile(Regex *re) {
+    Program *p = &re->prog;
+    int n_classes = 0, n_loops = 0;
+    size_t n_bytes = 0;
+
+    for (int i = 0; i < re->n_states; i++) {
+        State *s = re->states[i];
+        n_classes += (s->type == S_CCLASS);
+        n_loops += (s->type == S_AQ_NODE);
+        n_bytes += (s->type == S_LITERAL_STR) ? (size_t) s->data.lit.len : 0;
+    }
+
+    // Everything but the bytes is made of 32 bit pieces, so they go one after the other without padding
+    size_t insts_size = sizeof(Inst) * re->n_states;
+    size_t classes_size = sizeof(CharClass) * n_classes;
+    size_t loops_size = sizeof(AQData) * n_loops;
+    size_t cycles_size = sizeof(uint32_t) * re->n_states;
+    p->size = insts_size + classes_size + loops_size + cycles_size + n_bytes;
+
+    char *block = arena_alloc(re, p->size);
+    p->insts = (Inst *) block;
+    p->classes = (CharClass *) (block + insts_size);
+    p->loops = (AQData *) (block + insts_size + classes_size);
+    p->cycles = (uint32_t *) (block + insts_size + classes_size + loops_size);
+    p->bytes = (unsigned char *) (block + insts_size + classes_size + loops_size + cycles_size);
+    p->n = re->n_states;
+    p->n_loops = n_loops;
+
+    n_classes = n_loops = 0;
+    n_bytes = 0;
+
+    for (int i = 0; i < re->n_states; i++) {
+        State *s = re->states[i];
+        Inst *in = &p->insts[i];
+
+        memset(in, 0, sizeof(Inst));
+        in->next1 = inst_index(s->next1);
+        in->next2 = inst_index(s->next2);
+
+        switch (s->type) {
+            case S_LITERAL_CH:
+                in->op = OP_CHAR;
+                in->ch = s->data.ch;
+                break;
+
+            case S_LITERAL_STR:
+                in->op = OP_STR;
+                in->len = (uint16_t) s->data.lit.len;
+                in->arg = (uint32_t) n_bytes;
+                memcpy(&p->bytes[n_bytes], s->data.lit.str, s->data.lit.len);
+                n_bytes += s->data.lit.len;
+                break;
+
+            case S_META_CH:
+                in->op = OP_ANY;
+                break;
+
+            case S_CCLASS:
+                in->op = OP_CLASS;
+                in->arg = n_classes;
+                p->classes[n_classes++] = *s->data.cclass;
+                break;
+
+            // A group number of 0 doesn't capture anything so it's just a way through
+            case S_CG_NODE:
+                in->op = (s->data.cg > 0) ? OP_GROUP_START : (s->data.cg < 0) ? OP_GROUP_END : OP_SPLIT;
+                in->arg = (s->data.cg > 0) ? s->data.cg : -s->data.cg;
+                break;
+
+            // A group the pattern doesn't have never matched anything, so referencing it matches nothing
+            case S_BACK_REFERENCE:
+                in->op = (s->data.ch <= re->n_groups) ? OP_BACKREF : OP_SPLIT;
+                in->arg = (s->data.ch <= re->n_groups) ? (uint32_t) s->data.ch : 0;
+                break;
+
+            case S_AQ_RESET:
+                in->op = OP_LOOP_RESET;
+                break;
+
+            case S_AQ_NODE:
+                in->op = OP_LOOP;
+                in->arg = n_loops;
+                p->loops[n_loops++] = s->data.aq;
+                break;
+
+            case S_FINAL:
+                in->op = OP_MATCH;
+                in->arg = s->data.pattern;
+                break;
+
+            case S_NODE:
+            default:
+                in->op = OP_SPLIT;
+                break;
+        }
+    }
+
+    find_cycles(p);
+    regex_log("Program is %d instructions, %zu bytes\n", p->n, p->size);
+}
+
+static uint32_t inst_index(const State *s) {
+    return (s == NULL) ? NO_INST : (uint32_t) s->id;
+}
+
+/**
+ * Marks the instructions the backtracker could get back to without reading anything, the ones
+ * in a strongly connected component (Tarjan's, without the recursion) of the graph that only
+ * has the ways on that don't read anything
+ */
+static void find_cycles(Program *p) {
+    int n = p->n;
+    int *index = malloc(sizeof(int) * n);
+    int *low = malloc(sizeof(int) * n);
+    uint32_t *component = malloc(sizeof(uint32_t) * n);
+    uint32_t *calls = malloc(sizeof(uint32_t) * n);
+    unsigned char *next = malloc(n); // Which of the call's ways on gets looked at next
+    unsigned char *on_stack = calloc(n, 1);
+    int counter = 0, n_component = 0, n_calls = 0, marked = 0;
+
+    memset(p->cycles, 0, sizeof(uint32_t) * n);
+    for (int i = 0; i < n; i++)
+        index[i] = -1;
+
+    for (uint32_t root = 0; root < (uint32_t) n; root++) {
+        if (index[root] >= 0)
+            continue;
+
+        index[root] = low[root] = counter++;
+        component[n_component++] = root;
+        on_stack[root] = 1;
+        calls[n_calls] = root;
+        next[n_calls++] = 0;
+
+        while (n_calls > 0) {
+            uint32_t v = calls[n_calls - 1];
+
+            if (next[n_calls - 1] < 2) {
+                uint32_t w = empty_next(p, v, next[n_calls - 1]++);
+                if (w == NO_INST)
+                    continue;
+
+                if (index[w] < 0) {
+                    index[w] = low[w] = counter++;
+                    component[n_component++] = w;
+                    on_stack[w] = 1;
+                    calls[n_calls] = w;
+                    next[n_calls++] = 0;
+                } else if (on_stack[w] && index[w] < low[v]) {
+                    low[v] = index[w];
+                }
+                continue;
+            }
+
+            n_calls--;
+            if (n_calls > 0 && low[v] < low[calls[n_calls - 1]])
+                low[calls[n_calls - 1]] = low[v];
+            if (low[v] != index[v])
+                continue;
+
+            // v is the first of its component, everything above it on the stack is the rest
+            int first = n_component;
+            while (component[--first] != v)
+                ;
+            for (int i = first; i < n_component; i++) {
+                uint32_t s = component[i];
+                on_stack[s] = 0;
+                if (n_component - first > 1) {
+                    p->cycles[s] = 1;
+                    marked++;
+                }
+            }
+            n_component = first;
+        }
+    }
+
+    free(index);
+    free(low);
+    free(component);
+    free(calls);
+    free(next);
+    free(on_stack);
+
+    if (marked > 0 && p->n_loops > 0)
+        find_loop_bodies(p);
+    regex_log("%d instructions can be got back to without reading anything\n", marked);
+}
+
+// The way on from instruction i that doesn't read anything, NO_INST if which isn't one
+static uint32_t empty_next(const Program *p, uint32_t i, int which) {
+    const Inst *in = &p->insts[i];
+    switch (in->op) {
+        case OP_CHAR: case OP_STR: case OP_ANY: case OP_CLASS: case OP_MATCH:
+            return NO_INST;
+        default:
+            return (which == 0) ? in->next1 : in->next2;
+    }
+}
+
+/**
+ * A marked instruction inside a counting loop's body goes by that loop's epoch instead, the
+ * backtracker starts a new one for the goes round it that would be separate copies unrolled.
+ * The body is whatever the way round gets to that can get back to the loop, and the innermost
+ * loop is the one with the smallest body
+ */
+static void find_loop_bodies(Program *p) {
+    int n = p->n;
+    int *ahead = malloc(sizeof(int) * n); // Which loop last got to it going forwards
+    int *behind = malloc(sizeof(int) * n); // And going backwards
+    int *size = malloc(sizeof(int) * n); // Of the body it's been given
+    uint32_t *stack = malloc(sizeof(uint32_t) * n);
+
+    // Who comes before each instruction, in one array
+    int *first = calloc(n + 1, sizeof(int));
+    uint32_t *from = malloc(sizeof(uint32_t) * 2 * n);
+    for (int i = 0; i < n; i++) {
+        if (p->insts[i].next1 != NO_INST)
+            first[p->insts[i].next1 + 1]++;
+        if (p->insts[i].next2 != NO_INST)
+            first[p->insts[i].next2 + 1]++;
+    }
+    for (int i = 0; i < n; i++)
+        first[i + 1] += first[i];
+    int *fill = malloc(sizeof(int) * n);
+    memcpy(fill, first, sizeof(int) * n);
+    for (int i = 0; i < n; i++) {
+        if (p->insts[i].next1 != NO_INST)
+            from[fill[p->insts[i].next1]++] = i;
+        if (p->insts[i].next2 != NO_INST)
+            from[fill[p->insts[i].next2]++] = i;
+    }
+    free(fill);
+
+    for (int i = 0; i < n; i++)
+        ahead[i] = behind[i] = -1;
+
+    for (uint32_t loop = 0; loop < (uint32_t) n; loop++) {
+        const Inst *in = &p->insts[loop];
+        if (in->op != OP_LOOP)
+            continue;
+
+        int sp = 0, body = 0;
+        ahead[loop] = behind[loop] = loop;
+        stack[sp++] = in->next1;
+        ahead[in->next1] = loop;
+        while (sp > 0) {
+            const Inst *s = &p->insts[stack[--sp]];
+            if (s->next1 != NO_INST && ahead[s->next1] != (int) loop) {
+                ahead[s->next1] = loop;
+                stack[sp++] = s->next1;
+            }
+            if (s->next2 != NO_INST && ahead[s->next2] != (int) loop) {
+                ahead[s->next2] = loop;
+                stack[sp++] = s->next2;
+            }
+        }
+
+        stack[sp++] = loop;
+        while (sp > 0) {
+            uint32_t s = stack[--sp];
+            for (int j = first[s]; j < first[s + 1]; j++) {
+                if (behind[from[j]] != (int) loop) {
+                    behind[from[j]] = loop;
+                    body += (ahead[from[j]] == (int) loop);
+                    stack[sp++] = from[j];
+                }
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (p->cycles[i] != 0 && ahead[i] == (int) loop && behind[i] == (int) loop && i != (int) loop
+                && (p->cycles[i] == 1 || body < size[i])) {
+                p->cycles[i] = 2 + in->arg;
+                size[i] = body;
+            }
+        }
+    }
+
+    free(ahead);
+    free(behind);
+    free(size);
+    free(stack);
+    free(first);
+    free(from);
+}
@@ -3,7 +3,7 @@
  * Matching literal characters
  * 
  * Metacharacters:
- * - '.'  (Any character except '\0')
+ * - '.'  (Any character, including '\0' when the input comes with its length)
  * - '+'  Greedy quantifier (1 or more)
  * - '+?' Lazy quantifier (1 or more)
  * - '?'  Greedy quantifier (0 or 1)
@@ -26,120 +26,146 @@
 #include <string.h> // For strlen
 
 #include "regex.h"
+#include "regex_internal.h"
 
 
 
-/***** Defines *****/
-#define MAX_STACK_SIZE     64
-#define MAX_STRING_SIZE    256
-#define MAX_CAPTURE_GROUPS 100 // It's actually 99 but it's easier than putting + 1 everywhere
-#define MAX_REGEX_MALLOC   10000
-
-#define EXACT_QUANTIFIER     -1
-#define OPEN_ENDED_QUANTIFIER -2
+/**
+ * Captures are kept as offsets into the input, group n uses caps[2n] and caps[2n + 1]
+ * Whenever one changes (or one of the loop counters does) the old value goes in the undo
+ * log, so backtracking just winds the log back instead of copying everything around
+ */
+typedef struct CaptureUndo_ {
+    int *reg;
+    int old;
+} CaptureUndo;
 
+typedef struct BacktrackData_ {
+    uint32_t pc;
+    int pos;  // Offset into the input
+    int undo; // How far the undo log got before this was pushed
+} BacktrackData;
 
-/***** Datatypes *****/
 /**
- * Short_hands aren't included in StateType because they should get converted to something else
- * e.g \w get's changed to a character set matching [a-zA-Z0-9_]
+ * The backtrack stack and undo log live in the thread's Scratch and get reused for every offset
+ * and every call. They double in size when they fill up so nothing gets malloc'd per push
  */
-typedef enum {
-    M_ANY_CH = 1, // .
-} MetaChType;
-
-typedef struct AQData_ {
-    unsigned int max;
-    unsigned int min;
-    unsigned int visited;
-             int lazy;
-} AQData;
-
-typedef enum {
-    // Special States
-    S_FINAL = 1,
-    S_NODE,
-    S_CG_NODE, // Store capture group data
-    S_AQ_NODE,
-
-    // Normal States
-    S_LITERAL_CH,
-    S_META_CH,
-    S_CCLASS,
-    S_REVERSE_CCLASS,
-    S_BACK_REFERENCE,
-} StateType;
-
-typedef union StateData_ {
-    unsigned char ch; // for literal characters
-    MetaChType meta; // Meta character types
-    char *cclass;
-    char cg; // capture group number - negative number means we are leaving the group
-    struct AQData_ aq;
-} StateData;
-
-typedef struct State_ {
-    StateType type;
-
-    union StateData_ data;
-
-    struct State_ *next1;
-    struct State_ *next2;
-} State;
-
-
-typedef struct StateList_ {
-    struct State_ **l[MAX_STACK_SIZE];
+typedef struct Backtracker_ {
+    struct BacktrackData_ *stack;
     int n;
-} StateList;
+    int size;
 
-// Fragments of the state machine
-typedef struct Fragment_ {
-    struct State_ *start;
-    struct StateList_ *list;
-} Fragment;
+    struct CaptureUndo_ *undo;
+    int n_undo;
+    int undo_size;
 
-typedef struct CaptureGroupData_ {
-    int icg[MAX_CAPTURE_GROUPS];
-    int str_ptrs[MAX_CAPTURE_GROUPS];
-    char cgs[MAX_CAPTURE_GROUPS][MAX_STRING_SIZE];
-} CaptureGroupData;
+    // For each counting loop by state id, how many times it's been round and where the last go started
+    int *counts;
+    int *loop_pos;
 
-typedef struct BacktrackData_ {
-    char *string;
-    char *sp;
-    State *s;
+    // Where each instruction in prog.cycles was last run on the way here and in which epoch, and
+    // the epoch each counting loop is on (epochs[0] is the one outside them). Only used without the memo
+    int *seen_pos;
+    int *seen_epoch;
+    int *epochs;
+    int last_epoch;
 
-    // We also gotta keep track of where the capturing groups are upto
-    struct CaptureGroupData_ *cgd;
-} BacktrackData;
+    // One bit for every (state, position) that's been tried, NULL when the pattern or input rules it out
+    uint32_t *memo;
+    uint32_t *memo_bits;
+    size_t memo_size; // In words
+    int memo_stride; // Positions per state, len + 1
+
+    // Counted every time, they only go anywhere if somebody wants the stats
+    unsigned long long steps;
+    unsigned long long pushes;
+    unsigned long long pops;
+    int peak;
+} Backtracker;
 
 
-typedef struct Options_ {
-    unsigned int suppress_logging : 1;
-    unsigned int start_of_string  : 1; // When the '^' is used at the start of the string
-} Options;
+/**
+ * Everything the parser needs while it's going
+ * Each thread has its own so patterns can be compiled on different threads at the same time
+ */
+typedef struct Compiler_ {
+    Regex *re; // The Regex being compiled, everything the parser makes goes in its arena
+    int capturing_group; // used in parse_pattern to keep track of capturing groups
+    int group; // The group parse_pattern is inside right now, 0 if it isn't in one
+} Compiler;
+
+/**
+ * What repeat_fragment needs to copy a fragment, worked out once instead of for every copy:
+ * its states with the start first, where each one is in that list and whose pointer each of
+ * its loose ends is
+ */
+typedef struct FragmentCopier_ {
+    Fragment a;
+    State **states;
+    int n;
+    int *index; // By state id, only for the states in a
+    int *ends; // 2 * the state's place in states, + 1 if it's next2
+} FragmentCopier;
+
 
 /***** Constants *****/
-static Options options;
+static _Thread_local Compiler compiling;
+
+#ifdef REGEX_DEBUG
+// Whether regex_log prints anything, set from the options of whatever this thread is working on
+static _Thread_local int logging;
+#endif
 
-// used in parse_pattern to keep track of capturing groups. Only used for printing
-static int capturing_group = 0;
+_Thread_local RegexStats *match_stats;
 
-// ezpz way to free stuff
-static void **regex_free;
-static void **rfp; // regex_free pointer
-static Fragment err_fragment = {NULL, NULL};
+static const Fragment err_fragment = {NULL, NULL};
+
+// Tables for the shorthand classes, shared by every pattern that uses them
+static const CharClass digit_class = {{0, 0x03FF0000, 0, 0, 0, 0, 0, 0}};               // [0-9]
+static const CharClass word_class  = {{0, 0x03FF0000, 0x87FFFFFE, 0x07FFFFFE, 0, 0, 0, 0}}; // [A-Za-z0-9_]
+static const CharClass space_class = {{0x00002600, 0x00000001, 0, 0, 0, 0, 0, 0}};      // [\t\n\r ]
+
+static const CharClass not_digit_class = {{~0u, ~0x03FF0000u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u}};
+static const CharClass not_word_class  = {{~0u, ~0x03FF0000u, ~0x87FFFFFEu, ~0x07FFFFFEu, ~0u, ~0u, ~0u, ~0u}};
+static const CharClass not_space_class = {{~0x00002600u, ~0x00000001u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u}};
 
 
 
 
 /***** Function Prototypes *****/
 char *regex(char *pattern, char *string, unsigned int opts);
+Regex *regex_compile(char *pattern, unsigned int opts);
+char *regex_exec(Regex *re, char *string);
+char *regex_group(Regex *re, char *string, int group);
+int regex_find(Regex *re, const char *string, size_t len, long long *caps);
+int regex_group_count(Regex *re);
+int regex_match(Regex *re, char *string);
+int regex_match_len(Regex *re, const char *string, size_t len);
+int regex_match_parallel(Regex *re, const char *string, size_t len, int n_threads);
+void regex_match_batch(Regex *re, const RegexInput *inputs, int n, int *results, int n_threads);
+void regex_set_dfa_memory(Regex *re, size_t bytes);
+void regex_free(Regex *re);
+void regex_iter_init(RegexIter *it, Regex *re, const char *string, size_t len);
+int regex_iter_next(RegexIter *it, long long *caps);
+void regex_stats_start(RegexStats *stats);
+void regex_stats_stop(void);
+void stats_merge(RegexStats *into, const RegexStats *from);
+RegexSet *regex_set_compile(char **patterns, int n, unsigned int opts);
+int regex_set_match(RegexSet *rs, char *string, int *ids);
+void regex_set_memory(RegexSet *rs, size_t bytes);
+void regex_set_free(RegexSet *rs);
 static char *pre_parse_pattern(char *pattern);
 static Fragment parse_pattern(char **pattern);
-static char *perform_regex(State *start, char *string);
-static void capture_group_str_grab(CaptureGroupData *cgd, char ch);
+static int run_regex(Regex *re, char *string, int len, int *caps);
+static int match_string(Regex *re, char *string, int len);
+static int backtrack_exec(Regex *re, char *string, int len, int *caps);
+static int perform_regex(Backtracker *bt, const Program *prog, uint32_t start, char *input, int len, int pos, int *caps);
+static void memo_setup(Regex *re, Backtracker *bt, int len);
+static int pop_backtrack(Backtracker *bt, uint32_t *pc, int *pos, int *caps);
+static void backtrack_stats(Backtracker *bt, int starts);
+static int set_register(Backtracker *bt, int *reg, int value);
+static void wind_back(Backtracker *bt, int undo);
+void backtracker_free(Backtracker *bt);
 
 static int check_pattern_correctness(char *pattern);
 static int state_altering_check(char *p);
@@ -151,21 +177,36 @@ static int character_class_check(char *p);
 static Fragment *link_fragments(Fragment *fp, char *sp);
 static State *create_state(StateType type, StateData data, State * const next1, State * const next2);
 static Fragment create_fragment(State *s, StateList *l);
+static Fragment repeat_fragment(Fragment a, unsigned int min, unsigned int max, int lazy);
+static int copier_init(FragmentCopier *c, Fragment a);
+static Fragment clone_fragment(const FragmentCopier *c);
+static void copier_free(FragmentCopier *c);
 static void point_state_list(StateList *l, State *a);
 static StateList *create_state_list(State **first);
 static StateList *append_lists(StateList *a, StateList *b);
+static void arena_free(Regex *re);
 
-static char *create_character_class(char *sp, StateData *data);
+static char *create_character_class(char *sp, CharClass *c);
+static const CharClass *shorthand_class(char ch);
+static char escaped_ch(char ch);
 static State *parse_escapes(char **p);
 
 static int get_arbitrary_quantifier(char **p, int *a, int *b);
 
-static BacktrackData create_backtrack_data(char *string, char *sp, State *s, CaptureGroupData *cgd);
+static int push_backtrack(Backtracker *bt, uint32_t pc, int pos);
 
-static char *state_type_to_string(StateType type);
+static char *empty_string(void);
+static char *copy_substring(char *string, int start, int end);
+char *state_type_to_string(StateType type);
 //static char *meta_ch_type_to_string(MetaChType type);
 
-static void handle_options(unsigned int opts);
+static Options handle_options(unsigned int opts);
+static void use_options(const Regex *re);
+static size_t regex_footprint(const Regex *re);
+static Regex *create_regex(void);
+static State *compile_pattern(char *pattern, int pattern_id);
+static int states_need_backtrack(Regex *re, int first_state);
+static int states_can_memoize(Regex *re);
 
 
 // String stuff
@@ -174,73 +215,585 @@ static inline char peek_ch(char *str);
 static inline char reverse_peek_ch(char *str);
 
 static void pattern_error(char *p, unsigned int pos, unsigned int range, char *msg, ...);
-static void regex_log(char *msg, ...);
+#ifdef REGEX_DEBUG
+void regex_log(char *msg, ...);
+#endif
 
 
 
+// Convenience wrapper - runs the pattern once, it only gets compiled if it isn't in the cache (see cache.c)
 char *regex(char *pattern, char *string, unsigned int opts) {
-    // Handle options - should be moved to it's own function
-    handle_options(opts);
-    regex_free = malloc(sizeof(void *) * MAX_REGEX_MALLOC);
-    rfp = regex_free;
+    struct CacheEntry_ *entry;
+    Regex *re = cache_get(pattern, opts, &entry);
+    if (re == NULL)
+        return empty_string();
+
+    char *return_str = regex_exec(re, string);
+    cache_release(entry);
+
+    return return_str;
+}
+
+// Builds the state machine for a pattern. Returns NULL if the pattern is bad
+Regex *regex_compile(char *pattern, unsigned int opts) {
+    Options options = handle_options(opts);
 
     // Echoing back for no real reason
     regex_log("Pattern : \"%s\"\n", pattern);
-    regex_log("String  : \"%s\"\n", string);
 
     // We'd do some checking here maybe
     if (check_pattern_correctness(pattern))
-        return "";
+        return NULL;
+
+    Regex *re = create_regex();
+    re->options = options;
+    compiling.re = re;
+
+    // '^' gets picked up while parsing and goes straight in re->options
+    re->start = compile_pattern(pattern, 0);
+    compiling.re = NULL;
 
-    char *new_pattern = pre_parse_pattern(pattern);
-    Fragment fsm = parse_pattern(&new_pattern);
     // If we get back an error fragment then something's gone wrong
-    if (fsm.start == NULL) {
+    if (re->start == NULL) {
         regex_log("Aborting regex\n");
-        return "";
+        regex_free(re);
+        return NULL;
+    }
+
+    // The pike VM can't do anything that needs to remember what it matched earlier. It can't run
+    // joined up literals either, and REGEX_BACKTRACK still goes to it when the memo won't fit
+    re->needs_backtrack = states_need_backtrack(re, 0);
+    optimize_states(re, re->needs_backtrack);
+    re->can_memoize = states_can_memoize(re);
+    program_compile(re);
+
+    scan_compile(re);
+
+    return re;
+}
+
+// Compiles every pattern into one machine, leaving out the ones the DFA can't do
+RegexSet *regex_set_compile(char **patterns, int n, unsigned int opts) {
+    Options options = handle_options(opts);
+
+    // Checking them all first means there's nothing to clean up if one is bad
+    for (int i = 0; i < n; i++) {
+        regex_log("Pattern %d : \"%s\"\n", i, patterns[i]);
+        if (check_pattern_correctness(patterns[i]))
+            return NULL;
+    }
+
+    RegexSet *rs = malloc(sizeof(RegexSet));
+    rs->n = n;
+    rs->single = calloc(n, sizeof(Regex *));
+    rs->re = create_regex();
+
+    Regex *re = rs->re;
+    re->options = options;
+    re->set = arena_alloc(re, sizeof(SetPattern) * (n + 1));
+    compiling.re = re;
+
+    // Marking the ones that need to go on their own
+    unsigned char *single = calloc(n + 1, sizeof(unsigned char));
+
+    for (int i = 0; i < n; i++) {
+        int first_state = re->n_states;
+        re->options.start_of_string = 0;
+
+        State *start = compile_pattern(patterns[i], i);
+        if (start == NULL) {
+            regex_log("Aborting regex set\n");
+            compiling.re = NULL;
+            regex_set_free(rs);
+            free(single);
+            return NULL;
+        }
+
+        // The states stay in the arena but nothing points at them
+        if (states_need_backtrack(re, first_state)) {
+            single[i] = 1;
+            continue;
+        }
+
+        re->set[re->n_set].start = start;
+        re->set[re->n_set].anchored = re->options.start_of_string;
+        re->n_set++;
+    }
+
+    // Hanging everything off one root, in order so the first pattern has the highest priority
+    State *root = NULL;
+    StateData d = {.cg = 0};
+    for (int i = re->n_set - 1; i >= 0; i--)
+        root = create_state(S_NODE, d, re->set[i].start, root);
+
+    re->start = root;
+    compiling.re = NULL;
+
+    // Anchoring is done per pattern
+    re->options.start_of_string = 0;
+    re->needs_backtrack = 0;
+
+    if (re->n_set == 0) {
+        regex_free(re);
+        rs->re = NULL;
+    } else {
+        // Every DFA state holds a bit of every pattern so they get big quickly
+        re->dfa_mem_limit = DFA_DEFAULT_MEMORY * (1 + re->n_set / DFA_SET_PATTERNS);
+        optimize_states(re, 0);
+        program_compile(re);
+        scan_compile(re);
+    }
+
+    for (int i = 0; i < n; i++)
+        if (single[i])
+            rs->single[i] = regex_compile(patterns[i], opts);
+
+    free(single);
+    return rs;
+}
+
+// ids gets used to mark which patterns matched first, then packed down into the list of them
+int regex_set_match(RegexSet *rs, char *string, int *ids) {
+    int len = strlen(string);
+    size_t memory = 0;
+    memset(ids, 0, sizeof(int) * rs->n);
+    stats_input(len);
+
+    if (rs->re != NULL) {
+        use_options(rs->re);
+        memory += regex_footprint(rs->re);
+        dfa_exec_set(rs->re, string, len, ids);
     }
 
-    State *start = fsm.start;
+    for (int i = 0; i < rs->n; i++) {
+        if (rs->single[i] != NULL) {
+            use_options(rs->single[i]);
+            memory += regex_footprint(rs->single[i]);
+            ids[i] = match_string(rs->single[i], string, len);
+        }
+    }
+
+    // The whole set counts as the pattern
+    if (match_stats != NULL)
+        match_stats->memory = memory;
+
+    int n = 0;
+    for (int i = 0; i < rs->n; i++)
+        if (ids[i])
+            ids[n++] = i;
+
+    return n;
+}
+
+void regex_set_memory(RegexSet *rs, size_t bytes) {
+    if (rs->re != NULL)
+        regex_set_dfa_memory(rs->re, bytes);
+}
+
+void regex_set_free(RegexSet *rs) {
+    if (rs == NULL)
+        return;
+
+    for (int i = 0; i < rs->n; i++)
+        regex_free(rs->single[i]);
+
+    regex_free(rs->re);
+    free(rs->single);
+    free(rs);
+}
+
+// An empty Regex for the parser to put states in
+static Regex *create_regex(void) {
+    Regex *re = malloc(sizeof(Regex));
+    re->start = NULL;
+    re->serial = scratch_serial();
+    re->states_size = ARENA_BLOCK_SIZE / sizeof(State);
+    re->states = malloc(sizeof(State *) * re->states_size);
+    re->n_states = 0;
+    re->n_groups = 0;
+    re->needs_backtrack = 0;
+    re->can_memoize = 0;
+    re->arena = NULL;
+    re->dfa_mem_limit = DFA_DEFAULT_MEMORY;
+    re->set = NULL;
+    re->n_set = 0;
+
+    return re;
+}
+
+/**
+ * Parses pattern into the Regex being compiled and finishes it off with a final state
+ * Returns the start of the machine, or NULL if the pattern is bad
+ * pattern_id is what the final state reports when it's part of a set
+ */
+static State *compile_pattern(char *pattern, int pattern_id) {
+    char *new_pattern = pre_parse_pattern(pattern);
+    Fragment fsm = parse_pattern(&new_pattern);
+    int n_groups = compiling.capturing_group;
+    if (n_groups > compiling.re->n_groups)
+        compiling.re->n_groups = n_groups;
+    compiling.capturing_group = 0;
+    compiling.group = 0; // A bad pattern can bail out from inside a group
+
+    if (fsm.start == NULL)
+        return NULL;
+
+    // Every engine keeps the captures in arrays MAX_CAPTURE_GROUPS big
+    if (n_groups >= MAX_CAPTURE_GROUPS) {
+        pattern_error(pattern, 0, 0, "Too many capture groups, %d is the most a pattern can have\n",
+                      REGEX_MAX_GROUPS);
+        return NULL;
+    }
 
     // Adding the final state to the final fsm
-    StateData d = {.ch = '\0'};
+    StateData d = {.pattern = pattern_id};
     State *final = create_state(S_FINAL, d, NULL, NULL);
     point_state_list(fsm.list, final);
     regex_log("\nFinal State %p, Node State\n", (void *) final);
 
-    char *return_str = "";
+    return fsm.start;
+}
+
+// Back references and arbitrary quantifiers from states[first_state] onwards
+static int states_need_backtrack(Regex *re, int first_state) {
+    for (int i = first_state; i < re->n_states; i++)
+        if (re->states[i]->type == S_BACK_REFERENCE || re->states[i]->type == S_AQ_NODE)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * Back references depend on what got captured and arbitrary quantifiers on how many times they've
+ * been round, so with either of them the same state at the same position can go different ways
+ */
+static int states_can_memoize(Regex *re) {
+    for (int i = 0; i < re->n_states; i++)
+        if (re->states[i]->type == S_BACK_REFERENCE || re->states[i]->type == S_AQ_NODE)
+            return 0;
 
-    if (options.start_of_string) {
+    return 1;
+}
+
+// Runs a compiled pattern against a string. The returned string is freed by the caller
+char *regex_exec(Regex *re, char *string) {
+    int caps[2 * MAX_CAPTURE_GROUPS];
+
+    int len = strlen(string);
+
+    use_options(re);
+    stats_input(len);
+    regex_log("String  : \"%s\"\n", string);
+
+    if (!run_regex(re, string, len, caps)) {
+        regex_log("Regex Failed\n");
+        return empty_string();
+    }
+
+    char *return_str = copy_substring(string, caps[0], caps[1]);
+    regex_log("Returned string : %s\n\n", return_str);
+    return return_str;
+}
+
+/**
+ * Same as regex_exec but hands back what capture group number group matched instead
+ * This is the only place the text of a capture group gets copied out of the input
+ */
+char *regex_group(Regex *re, char *string, int group) {
+    int caps[2 * MAX_CAPTURE_GROUPS];
+    int len = strlen(string);
+
+    use_options(re);
+    stats_input(len);
+    if (group < 0 || group > re->n_groups || !run_regex(re, string, len, caps))
+        return empty_string();
+
+    if (caps[2 * group] == -1 || caps[2 * group + 1] == -1)
+        return empty_string();
+
+    return copy_substring(string, caps[2 * group], caps[2 * group + 1]);
+}
+
+/**
+ * The engines only ever work with offsets into the input, so this just hands them straight
+ * back. The copy regex_exec makes is the only place matched text gets moved anywhere
+ * regex_compile won't take more groups than offsets has room for, so this never writes past
+ * 2 * (REGEX_MAX_GROUPS + 1) of caps either
+ */
+int regex_find(Regex *re, const char *string, size_t len, long long *caps) {
+    int offsets[2 * MAX_CAPTURE_GROUPS];
+
+    use_options(re);
+    stats_input(len);
+    if (!run_regex(re, (char *) string, len > INT_MAX ? INT_MAX : (int) len, offsets))
+        return 0;
+
+    for (int i = 0; i < 2 * (re->n_groups + 1); i++)
+        caps[i] = offsets[i];
+    return 1;
+}
+
+int regex_group_count(Regex *re) {
+    return re->n_groups;
+}
+
+/**
+ * Picks an engine. Returns 1 if there was a match and fills caps with the offsets
+ * REGEX_BACKTRACK only gets the backtracker while the memo fits, past that it can take exponential
+ * time where the pike VM never does, and the pike VM finds the same match
+ */
+static int run_regex(Regex *re, char *string, int len, int *caps) {
+    if (!re->needs_backtrack
+        && (!re->options.backtrack || (size_t) re->n_states * (len + 1) > MEMO_MAX_BITS))
+        return pike_exec(re, string, len, caps);
+
+    return backtrack_exec(re, string, len, caps);
+}
+
+// Tries perform_regex at every offset until one gives back a non-empty match
+static int backtrack_exec(Regex *re, char *string, int len, int *caps) {
+    Scratch *sc = regex_scratch(re);
+    if (sc->backtracker == NULL) {
+        Backtracker *bt = malloc(sizeof(Backtracker));
+        bt->size = MAX_STACK_SIZE;
+        bt->stack = malloc(sizeof(BacktrackData) * bt->size);
+        bt->undo_size = MAX_STACK_SIZE;
+        bt->undo = malloc(sizeof(CaptureUndo) * bt->undo_size);
+        bt->counts = malloc(sizeof(int) * re->n_states);
+        bt->loop_pos = malloc(sizeof(int) * re->n_states);
+        bt->seen_pos = malloc(sizeof(int) * re->n_states);
+        bt->seen_epoch = malloc(sizeof(int) * re->n_states);
+        bt->epochs = malloc(sizeof(int) * (re->prog.n_loops + 1));
+        bt->memo_bits = NULL;
+        bt->memo_size = 0;
+        sc->backtracker = bt;
+    }
+
+    Backtracker *bt = sc->backtracker;
+    memo_setup(re, bt, len);
+
+    // The undo log from the last call is thrown away rather than wound back, so anything that's
+    // only ever changed through it has to be put back by hand
+    bt->n_undo = 0;
+    if (bt->memo == NULL) {
+        for (int i = 0; i < re->n_states; i++)
+            bt->seen_pos[i] = bt->seen_epoch[i] = -1;
+        for (int i = 0; i <= re->prog.n_loops; i++)
+            bt->epochs[i] = 0;
+        bt->last_epoch = 0;
+    }
+    bt->steps = bt->pushes = bt->pops = 0;
+    bt->peak = 0;
+
+    for (int i = 0; i < 2 * (re->n_groups + 1); i++)
+        caps[i] = -1;
+
+    if (re->options.start_of_string) {
         regex_log("\n\nStart of string only\n");
         regex_log("Regex Iteration 1\n");
-        return_str = perform_regex(start, string);
+        regex_trace(REGEX_TRACE_START, 0, 0);
+        int matched = perform_regex(bt, &re->prog, re->start->id, string, len, 0, caps);
+        backtrack_stats(bt, 1);
+        return matched == 1 && caps[1] != caps[0];
+    }
 
-    } else {
-        // Do the regex at each point of the string
-        for (int i = 0; *(string + i) != '\0'; i++) {
-            regex_log("\n\nRegex Iteration %d\n", i + 1);
-            return_str = perform_regex(start, string + i);
-            if (*return_str != '\0')
-                break;
-            else
-                regex_log("\nIteration %d failed\n\n", i + 1);
+    // Do the regex at each point of the string where a match could start
+    int starts = 0;
+    for (int i = scan_first(re, string, 0, len); i < len; i = scan_first(re, string, i + 1, len)) {
+        regex_log("\n\nRegex Iteration %d\n", i + 1);
+        regex_trace(REGEX_TRACE_START, 0, i);
+        starts++;
+        int matched = perform_regex(bt, &re->prog, re->start->id, string, len, i, caps);
+        if (matched == 1 && caps[1] != caps[0]) {
+            backtrack_stats(bt, starts);
+            return 1;
         }
+
+        // A later start can't be trusted when this one never found out whether it matched
+        if (matched < 0) {
+            regex_log("\nRan out of memory, giving up\n");
+            break;
+        }
+
+        regex_log("\nIteration %d failed\n\n", i + 1);
     }
 
-    if (*return_str == '\0')
-        regex_log("Regex Failed\n");
-    else
-        regex_log("Returned string : %s\n\n", return_str);
+    backtrack_stats(bt, starts);
+    return 0;
+}
 
-    // Cleanup
-    capturing_group = 0;
+// Hands what the backtracker counted over to the stats, if anybody's collecting them
+static void backtrack_stats(Backtracker *bt, int starts) {
+    RegexStats *st = match_stats;
+    if (st == NULL)
+        return;
+
+    st->states += bt->steps;
+    st->starts += starts;
+    st->pushes += bt->pushes;
+    st->pops += bt->pops;
+    if ((unsigned long long) bt->peak > st->peak_depth)
+        st->peak_depth = bt->peak;
+}
+
+void backtracker_free(Backtracker *bt) {
+    if (bt == NULL)
+        return;
+
+    free(bt->stack);
+    free(bt->undo);
+    free(bt->counts);
+    free(bt->loop_pos);
+    free(bt->seen_pos);
+    free(bt->seen_epoch);
+    free(bt->epochs);
+    free(bt->memo_bits);
+    free(bt);
+}
+
+// Returns 1 if there's a match anywhere in string, without working out what it is
+int regex_match(Regex *re, char *string) {
+    int len = strlen(string);
+
+    use_options(re);
+    stats_input(len);
+    return match_string(re, string, len);
+}
 
-    while (rfp != regex_free) {
-        free(*--rfp);
+// regex_match when the length is already known, so the string doesn't have to end with a NUL
+int regex_match_len(Regex *re, const char *string, size_t len) {
+    use_options(re);
+    stats_input(len);
+    return match_string(re, (char *) string, len > INT_MAX ? INT_MAX : (int) len);
+}
+
+// regex_match without the setup, so a RegexSet doesn't count its input more than once
+static int match_string(Regex *re, char *string, int len) {
+    if (re->options.backtrack || re->needs_backtrack) {
+        int caps[2 * MAX_CAPTURE_GROUPS];
+        return run_regex(re, string, len, caps);
     }
-    free(regex_free);
 
-    return return_str;
+    return dfa_exec(re, string, len);
+}
+
+// regex_match for one big buffer, see parallel.c for how it gets split up
+int regex_match_parallel(Regex *re, const char *string, size_t len, int n_threads) {
+    use_options(re);
+    stats_input(len);
+
+    // The backtracker has to start from the beginning of the input so there's nothing to split
+    if (re->options.backtrack || re->needs_backtrack) {
+        int caps[2 * MAX_CAPTURE_GROUPS];
+        return run_regex(re, (char *) string, len > INT_MAX ? INT_MAX : (int) len, caps);
+    }
+
+    return parallel_exec(re, string, len, n_threads);
+}
+
+// regex_match for every input in one go, the setup only happens once for the lot
+void regex_match_batch(Regex *re, const RegexInput *inputs, int n, int *results, int n_threads) {
+    use_options(re);
+    for (int i = 0; i < n && match_stats != NULL; i++)
+        stats_input(inputs[i].len);
+
+    if (re->options.backtrack || re->needs_backtrack) {
+        int caps[2 * MAX_CAPTURE_GROUPS];
+        for (int i = 0; i < n; i++) {
+            int len = inputs[i].len > INT_MAX ? INT_MAX : (int) inputs[i].len;
+            results[i] = run_regex(re, (char *) inputs[i].string, len, caps);
+        }
+        return;
+    }
+
+    parallel_batch(re, inputs, n, results, n_threads);
+}
+
+// Caps how much memory the DFA can use to cache states before it starts throwing them away
+void regex_set_dfa_memory(Regex *re, size_t bytes) {
+    // There has to be room for a few states or the DFA never gets anywhere
+    size_t min = 4 * (sizeof(void *) * 260 + sizeof(int) * re->n_states);
+    re->dfa_mem_limit = bytes > min ? bytes : min;
+
+    // This thread's cache gets made again with the new limit, anybody else's sticks to it once they fill up
+    scratch_release(re);
+}
+
+void regex_free(Regex *re) {
+    if (re == NULL)
+        return;
+
+    scratch_release(re);
+    arena_free(re);
+    free(re->states);
+    free(re);
+}
+
+void regex_iter_init(RegexIter *it, Regex *re, const char *string, size_t len) {
+    it->re = re;
+    it->string = string;
+    it->len = len;
+    it->pos = 0;
+}
+
+/**
+ * Runs the pattern over whatever is left after the last match, so every match reuses the same
+ * compiled pattern and the same scratch space. Nothing in the language looks behind where a
+ * match starts (apart from '^'), so matching the rest of the string on its own gives the same
+ * answer as starting part way through the whole thing
+ */
+int regex_iter_next(RegexIter *it, long long *caps) {
+    Regex *re = it->re;
+
+    // '^' can only match at the very start, which has already had its go
+    if (it->pos >= it->len || (it->pos > 0 && re->options.start_of_string))
+        return 0;
+
+    if (!regex_find(re, it->string + it->pos, it->len - it->pos, caps)) {
+        it->pos = it->len;
+        return 0;
+    }
+
+    for (int i = 0; i < 2 * (re->n_groups + 1); i++)
+        if (caps[i] != -1)
+            caps[i] += it->pos;
+
+    it->pos = caps[1];
+    return 1;
+}
+
+void regex_stats_start(RegexStats *stats) {
+    memset(stats, 0, sizeof(RegexStats));
+    match_stats = stats;
+}
+
+void regex_stats_stop(void) {
+    match_stats = NULL;
+}
+
+/**
+ * Adds one lot of stats to another, for threads that counted on their own (see parallel.c)
+ * into can be shared between threads so it's all done atomically
+ */
+void stats_merge(RegexStats *into, const RegexStats *from) {
+    __atomic_add_fetch(&into->calls, from->calls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->bytes, from->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->states, from->states, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->starts, from->starts, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->prefilter_skips, from->prefilter_skips, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->pushes, from->pushes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->pops, from->pops, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->dfa_hits, from->dfa_hits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->dfa_misses, from->dfa_misses, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&into->dfa_flushes, from->dfa_flushes, __ATOMIC_RELAXED);
+
+    // Every thread has a cache of its own so they all count
+    __atomic_add_fetch(&into->dfa_memory, from->dfa_memory, __ATOMIC_RELAXED);
+
+    unsigned long long peak = __atomic_load_n(&into->peak_depth, __ATOMIC_RELAXED);
+    while (from->peak_depth > peak && !__atomic_compare_exchange_n(&into->peak_depth, &peak, from->peak_depth,
+            1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
 
@@ -263,13 +816,15 @@ static Fragment parse_pattern(char **pattern) {
     Fragment *fp = &stack[0]; // fragments pointer
     Fragment volatile a, b; // These get optimized out and it breaks alternation
     int cap_group_tmp; // For use when we get '('
+    int outer_group;
 
     // Creating the first state
     // If we are in a capturing group, we change the data
+    // Every alternative in a group starts it again, so this is the group we're in rather than the last one opened
     StateData data;
-    data.cg = capturing_group;
+    data.cg = compiling.group;
     State *s;
-    if (capturing_group != 0) {
+    if (compiling.group != 0) {
         s = create_state(S_CG_NODE, data, NULL, NULL);
         regex_log("Start of parse_pattern: State %p, Capture Group Node State\n", (void *) s);
     } else {
@@ -284,54 +839,41 @@ static Fragment parse_pattern(char **pattern) {
         switch (*(*pattern)) {
             case '{': // Arbitrary quantifiers
                 regex_log("Arbitrary quantifier\n");
-                data.aq.visited = UINT_MAX; // Overflows back to 0 on first visit
                 int aq1, aq2;
 
-                if (get_arbitrary_quantifier(pattern, &aq1, &aq2)) {
+                // Nothing in front of it to repeat, so it's just characters
+                if (fp - stack < 2)
+                    goto def;
 
+                if (get_arbitrary_quantifier(pattern, &aq1, &aq2)) {
+                    unsigned int aq_min = aq1;
+                    unsigned int aq_max = (aq2 == EXACT_QUANTIFIER) ? (unsigned int) aq1
+                                        : (aq2 == OPEN_ENDED_QUANTIFIER) ? UINT_MAX : (unsigned int) aq2;
 
-                    if (aq1 > aq2 && aq2 > 0) {
+                    if (aq_min > aq_max) {
                         regex_log("Arbitrary quantifier minimum \"%d\" is greater than the maximum \"%d\"\n",
                                 aq1, aq2);
                         return err_fragment;
                     }
 
+                    int lazy = 0;
                     if (peek_ch(*pattern) == '?') {
                         (*pattern)++; // Moving onto the question mark
-                        data.aq.lazy = 1;
-                    } else {
-                        data.aq.lazy = 0;
+                        lazy = 1;
                     }
 
-                    if (aq1 == 0 && aq2 == -1) { // edge case {0}
+                    // Past MAX_UNROLL_STATES it only runs on the backtracker, see repeat_fragment
+                    a = *--fp;
+                    if (aq_max == 0) {
+                        // {0} matches nothing so whatever it was on gets dropped
                         regex_log("Edge case {0} handled\n");
-                        (*pattern)++;
-                        fp--;
-
-                    } else if (aq1 == 0) { // exact/open-ended/arbitrary quantifier that start with zero 
-                        // Realistically won't hit UINT_MAX
-                        //aq2 == OPEN_ENDED_QUANTIFIER ? data.aq.max = UINT_MAX : data.aq.max = aq2;
-                        data.aq.min = aq1;
-
-                    } else { // exact/open-ended/arbitrary quantifier that start non zero 
-                        data.aq.min = aq1;
-                        data.aq.max = (aq2 == EXACT_QUANTIFIER) ? (unsigned int) aq1
-                               : (aq2 == OPEN_ENDED_QUANTIFIER) ? UINT_MAX : (unsigned int) aq2;
-
-                        // Works the same as case '+'
-                        a = *--fp;
-                        s = data.aq.lazy == 0 ? create_state(S_AQ_NODE, data, a.start, NULL)
-                                              : create_state(S_AQ_NODE, data, NULL, a.start);
-                        point_state_list(a.list, s);
-                        *fp++ = data.aq.lazy == 0 ? create_fragment(s, create_state_list(&s->next2))
-                                                  : create_fragment(s, create_state_list(&s->next1));
-
+                    } else {
+                        *fp++ = repeat_fragment(a, aq_min, aq_max, lazy);
+                        regex_log("Arbitrary quantifier: min %u, max %u, lazy = %s\n",
+                                aq_min, aq_max, lazy ? "Yes" : "No");
                         fp = link_fragments(fp, (*pattern));
-                        (*pattern)++;
-                        regex_log("Arbitray Quantifier: State %p, AQ Node State aq max %u, aq min %u",
-                                (void *) s, data.aq.max, data.aq.min);
-                        regex_log(", lazy = %s\n", data.aq.lazy == 1 ? "Yes" : "No");
                     }
+                    (*pattern)++;
 
                 } else {
                     regex_log("Badly formatted arbitrary quantifier, parsing as literal characters\n");
@@ -349,16 +891,19 @@ static Fragment parse_pattern(char **pattern) {
                 break;
 
             case '^':
-                options.start_of_string = 1;
+                compiling.re->options.start_of_string = 1;
                 (*pattern)++;
                 break;
 
             case '(':
-                regex_log("\nCapturing group %d\n", ++capturing_group);
-                cap_group_tmp = capturing_group;
+                cap_group_tmp = ++compiling.capturing_group;
+                regex_log("\nCapturing group %d\n", cap_group_tmp);
                 (*pattern)++; // Moving into the paren
 
+                outer_group = compiling.group;
+                compiling.group = cap_group_tmp;
                 a = parse_pattern(pattern); // Collect everything inside the parentheses
+                compiling.group = outer_group;
                 data.cg = 0 - cap_group_tmp; // negating the number to show we are leaving the group
                 s = create_state(S_CG_NODE, data, NULL, NULL);
                 point_state_list(a.list, s);
@@ -367,27 +912,31 @@ static Fragment parse_pattern(char **pattern) {
                 fp = link_fragments(fp, (*pattern)); // **pattern is ')' so we can check the next char
 
                 (*pattern)++; // Move past the ')'
-                regex_log("\nEnd of Capturing group %d\n\n", capturing_group);
+                regex_log("\nEnd of Capturing group %d\n\n", compiling.capturing_group);
                 break;
 
             case ')':
                 return *stack;
 
-            case '[':
+            case '[': ;
+                CharClass *cclass = arena_alloc(compiling.re, sizeof(CharClass));
                 if (*((*pattern) + 1) == '^') {
                     (*pattern) += 2;
-                    (*pattern) = create_character_class(*pattern, &data);
-                    s = create_state(S_REVERSE_CCLASS, data, NULL, NULL);
+                    (*pattern) = create_character_class(*pattern, cclass);
+
+                    // Flipping it now so matching is the same as a normal class
+                    for (int i = 0; i < 8; i++)
+                        cclass->bits[i] = ~cclass->bits[i];
                 } else {
-                    (*pattern) = create_character_class(++(*pattern), &data);
-                    s = create_state(S_CCLASS, data, NULL, NULL);
+                    (*pattern) = create_character_class(++(*pattern), cclass);
                 }
+                data.cclass = cclass;
+                s = create_state(S_CCLASS, data, NULL, NULL);
                 *fp++ = create_fragment(s, create_state_list(&s->next1));
 
                 // check if we should link this fragment with the one before it
                 fp = link_fragments(fp, (*pattern));
-                regex_log("State %p, Type = %s, range = %s\n",
-                        (void *) s, state_type_to_string(s->type), s->data.cclass);
+                regex_log("State %p, Type = %s\n", (void *) s, state_type_to_string(s->type));
                 (*pattern)++;
                 break;
 
@@ -400,7 +949,7 @@ static Fragment parse_pattern(char **pattern) {
                 data.ch = '\0';
                 s = create_state(S_NODE, data, a.start, b.start);
                 *fp++ = create_fragment(s, append_lists(a.list, b.list));
-                fp = link_fragments(fp, (*pattern) - 1);
+                // Nothing to link here, the recursive call has already eaten up to the ')' or the end
                 regex_log("Alternation: State %p, Node State\n", (void *) s);
                 break;
 
@@ -494,260 +1043,400 @@ static Fragment parse_pattern(char **pattern) {
     return stack[0];
 }
 
-// Naviagtes the FSM and (should) returns the matched sub-string
-static char *perform_regex(State *start, char *string) {
-    regex_log("\n----- Navigating Finite State Machine -----\n");
-
-    // Backtracking related
-    BacktrackData *backtrack_stack = malloc(sizeof(BacktrackData) * MAX_STACK_SIZE);
-    BacktrackData *btp = backtrack_stack;
-    BacktrackData b;
-    int do_backtrack = 0;
+/**
+ * Runs the program from instruction start at offset pos in input
+ * Returns 1 if it gets to OP_MATCH, with the captures filled in as offsets from the start of input,
+ * and -1 if it ran out of memory before it could tell
+ *
+ * Every instruction's code finishes by going straight to the next one's. With computed goto each
+ * of those jumps is a separate branch, so the CPU gets to learn what tends to follow what instead
+ * of everything going through the one jump at the top of a switch
+ */
+#ifdef COMPUTED_GOTO
+// Label addresses aren't ISO C, which is the whole point here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define VM_CASE(op)   L_##op: case op
+#define VM_DISPATCH() goto *labels[in->op]
+#else
+#define VM_CASE(op)   case op
+#define VM_DISPATCH() goto dispatch
+#endif
 
-    // Capturing group related - This is the worst and only way I can imagine doing this
-    // We capture upto 99 groups used to check whether we should be collecting
-    CaptureGroupData *cgd = malloc(sizeof(CaptureGroupData));
+// On to the instruction at pc
+#define VM_NEXT() do {                              \
+        in = &insts[pc];                            \
+        bt->steps++;                                \
+        if (bt->memo != NULL)                       \
+            goto memo;                              \
+        if (prog->cycles[pc] != 0)                  \
+            goto cycle;                             \
+        regex_trace(REGEX_TRACE_STEP, pc, pos);     \
+        VM_DISPATCH();                              \
+    } while (0)
+
+// Running out of memory part way through gives up on the whole search, see backtrack_exec
+#define VM_PUSH(to) do {                            \
+        if (!push_backtrack(bt, (to), pos))         \
+            return -1;                              \
+    } while (0)
+
+#define VM_SET(reg, value) do {                     \
+        if (!set_register(bt, (reg), (value)))      \
+            return -1;                              \
+    } while (0)
+
+// Back to the last place there was another way to go
+#define VM_FAIL() do {                              \
+        if (!pop_backtrack(bt, &pc, &pos, caps))    \
+            return 0;                               \
+        VM_NEXT();                                  \
+    } while (0)
+
+static int perform_regex(Backtracker *bt, const Program *prog, uint32_t start, char *input, int len, int pos, int *caps) {
+#ifdef COMPUTED_GOTO
+    static const void *labels[OP_COUNT] = {
+        [OP_CHAR] = &&L_OP_CHAR, [OP_STR] = &&L_OP_STR, [OP_ANY] = &&L_OP_ANY, [OP_CLASS] = &&L_OP_CLASS,
+        [OP_SPLIT] = &&L_OP_SPLIT, [OP_GROUP_START] = &&L_OP_GROUP_START, [OP_GROUP_END] = &&L_OP_GROUP_END,
+        [OP_BACKREF] = &&L_OP_BACKREF, [OP_LOOP_RESET] = &&L_OP_LOOP_RESET, [OP_LOOP] = &&L_OP_LOOP,
+        [OP_MATCH] = &&L_OP_MATCH,
+    };
+#endif
+    const Inst *insts = prog->insts;
+    const Inst *in;
+    uint32_t pc = start;
+    unsigned int g;
+
+    regex_log("\n----- Running program -----\n");
+
+    // Whatever the last go left in the captures gets wound back
+    bt->n = 0;
+    wind_back(bt, 0);
+    caps[0] = pos;
+
+    VM_NEXT();
+
+    // Been here before and it didn't lead to a match, so it won't this time either
+memo: {
+        size_t bit = (size_t) pc * bt->memo_stride + pos;
+        if (bt->memo[bit >> 5] & (1u << (bit & 31))) {
+            regex_log("Already tried instruction %u at %d\n", pc, pos);
+            regex_trace(REGEX_TRACE_MEMO, pc, pos);
+            VM_FAIL();
+        }
+        bt->memo[bit >> 5] |= 1u << (bit & 31);
+        regex_trace(REGEX_TRACE_STEP, pc, pos);
+        VM_DISPATCH();
+    }
 
+    /**
+     * Without the memo a loop round something that can match nothing would go round for ever.
+     * Being back somewhere without having read anything since means whatever there was to try
+     * from here is already being tried further down, so this way is dropped at the same place
+     * the memo would have dropped it. It only looks back along the way it came, the marks are
+     * undone with everything else when it backtracks
+     */
+cycle: {
+        // A counting loop is only the same place again once it's into the goes that are the same copy
+        if (in->op == OP_LOOP && (unsigned int) bt->counts[pc] + 1 < prog->loops[in->arg].min) {
+            regex_trace(REGEX_TRACE_STEP, pc, pos);
+            VM_DISPATCH();
+        }
 
-    for (int i = 0; i < MAX_CAPTURE_GROUPS; i++) {
-        // Defaulting values
-        cgd->icg[i] = 0;
-        cgd->str_ptrs[i] = 0;
-        cgd->cgs[i][0] = '\0';
+        int epoch = bt->epochs[prog->cycles[pc] - 1];
+        if (bt->seen_pos[pc] == pos && bt->seen_epoch[pc] == epoch) {
+            regex_log("Back at instruction %u at %d without reading anything\n", pc, pos);
+            regex_trace(REGEX_TRACE_MEMO, pc, pos);
+            VM_FAIL();
+        }
+        VM_SET(&bt->seen_pos[pc], pos);
+        if (bt->seen_epoch[pc] != epoch)
+            VM_SET(&bt->seen_epoch[pc], epoch);
+        regex_trace(REGEX_TRACE_STEP, pc, pos);
+        VM_DISPATCH();
     }
 
-    State *s = start; // This is the state we are checking
-    char *rtn_str = malloc(sizeof(char) * MAX_STRING_SIZE); // This get's freed by the caller of regex()
-    char *sp = rtn_str;
-
-    while (1) {
-        regex_log("State %p, ", (void *) s);
+#ifndef COMPUTED_GOTO
+dispatch:
+#endif
+    switch (in->op) {
+        VM_CASE(OP_CHAR):
+            if (pos < len && in->ch == (unsigned char) input[pos]) {
+                regex_log("Literal character \"%c\" matched\n", in->ch);
+                pos++;
+                pc = in->next1;
+                VM_NEXT();
+            }
+            regex_log("Literal character \"%c\" did not match\n", in->ch);
+            VM_FAIL();
+
+        VM_CASE(OP_STR):
+            if (len - pos >= in->len && !memcmp(input + pos, &prog->bytes[in->arg], in->len)) {
+                regex_log("Literal string \"%.*s\" matched\n", in->len, &prog->bytes[in->arg]);
+                pos += in->len;
+                pc = in->next1;
+                VM_NEXT();
+            }
+            regex_log("Literal string \"%.*s\" did not match\n", in->len, &prog->bytes[in->arg]);
+            VM_FAIL();
+
+        // Matches anything, the only thing that stops it is running out of input
+        VM_CASE(OP_ANY):
+            if (pos < len) {
+                regex_log("Meta Character \".\" matched\n");
+                pos++;
+                pc = in->next1;
+                VM_NEXT();
+            }
+            regex_log("Meta Character \".\" ran out of input\n");
+            VM_FAIL();
+
+        VM_CASE(OP_CLASS):
+            if (pos < len && cclass_has(&prog->classes[in->arg], input[pos])) {
+                regex_log("Character class matched with character \"%c\" in string \n", input[pos]);
+                pos++;
+                pc = in->next1;
+                VM_NEXT();
+            }
+            regex_log("Character class did not match\n");
+            VM_FAIL();
+
+        VM_CASE(OP_SPLIT):
+            if (in->next2 != NO_INST)
+                VM_PUSH(in->next2);
+            pc = in->next1;
+            VM_NEXT();
+
+        // We only collect once, so "(abc)+" shouldn't result in "abcabc" etc for the capture string
+        VM_CASE(OP_GROUP_START):
+            g = in->arg;
+            if (caps[2 * g] == -1 && caps[2 * g + 1] == -1)
+                VM_SET(&caps[2 * g], pos);
+            pc = in->next1;
+            VM_NEXT();
+
+        // Once the end is set we've already been here
+        VM_CASE(OP_GROUP_END):
+            g = in->arg;
+            if (caps[2 * g + 1] == -1)
+                VM_SET(&caps[2 * g + 1], pos);
+            pc = in->next1;
+            VM_NEXT();
+
+        VM_CASE(OP_BACKREF): ;
+            g = in->arg;
+            int cg_start = caps[2 * g];
+            int cg_end = caps[2 * g + 1];
+
+            // If we are inside the capture group we can't reference it e.g (ab\1)
+            if (cg_start != -1 && cg_end == -1) {
+                regex_log("Regex engine runtime error: Can't backreference whilst inside the capture group\n");
+                return 0;
+            }
 
-        switch (s->type) {
-            case S_BACK_REFERENCE:
-                // If we are inside the capture group we can't reference it e.g (ab\1)
-                if (cgd->icg[s->data.ch - 1] == 1) {
-                    regex_log("Regex engine runtime error: Can't backreference whilst inside the capture group\n");
-                    return "";
-                }
+            // A group that never matched anything references an empty string
+            int brp = (cg_start != -1) ? cg_start : 0; // Back reference position
+            int brp_end = (cg_start != -1) ? cg_end : 0;
 
-                // Start matching the string in cgs to the supplied string
-                const char *brp = &cgd->cgs[s->data.ch - 1][0]; // Back reference pointer
-                regex_log("Back reference matching\n");
+            while (brp != brp_end && pos < len && input[brp] == input[pos]) {
+                brp++;
+                pos++;
+            }
 
-                while (*brp == *string && *brp != '\0' && *string != '\0') {
-                    regex_log("Literal character \"%c\" matched character \"%c\" in string\n", *brp, *string);
-                    brp++;
-                    capture_group_str_grab(cgd, *string);
-                    *sp++ = *string++;
+            if (brp != brp_end) {
+                regex_log("Back reference to group %u did not match\n", g);
+                VM_FAIL();
+            }
+            regex_log("Back reference to group %u matched\n", g);
+            pc = in->next1;
+            VM_NEXT();
+
+        // Coming into the loop from outside so it starts counting from scratch
+        VM_CASE(OP_LOOP_RESET):
+            regex_log("Counting loop reset, loop = %u\n", in->next1);
+            VM_SET(&bt->counts[in->next1], -1);
+            VM_SET(&bt->loop_pos[in->next1], -1);
+            pc = in->next1;
+            VM_NEXT();
+
+        // Gets here once on the way in and again after every go round the loop
+        VM_CASE(OP_LOOP): ;
+            const AQData *aq = &prog->loops[in->arg];
+            int count = bt->counts[pc] + 1;
+            regex_log("Counting loop, max = %u, min = %u, count = %d\n", aq->max, aq->min, count);
+
+            /**
+             * A go round that didn't match anything, the same as unrolled: the goes the count
+             * needs are separate copies so they can be empty, the last of those loops like '+'
+             * so it can only leave, and going round again after that gets dropped
+             */
+            if (count > 0 && pos == bt->loop_pos[pc] && (unsigned int) count >= aq->min) {
+                if ((unsigned int) count > aq->min) {
+                    regex_log("Nothing matched going round counting loop %u, not going round again\n", pc);
+                    VM_FAIL();
                 }
-                // Making the whole of the backreference has matched
-                if (*brp != '\0') {
-                    regex_log("Literal character \"%c\" did not match character \"%c\" in string\n",
-                            *brp, *string);
-                    do_backtrack = 1;
-                } else if (s->next2)
-                    *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
-
-                s = s->next1;
-                break;
-
-            case S_REVERSE_CCLASS:
-                // If we get a match
-                if (!match_ch_str(*string, s->data.cclass) && *string != '\0') {
-                    regex_log("Reverse character class \"%s\" matched with character \"%c\" in string \n",
-                           s->data.cclass, *string);
-
-                    capture_group_str_grab(cgd, *string);
-                    *sp++ = *string++;
-                    if (s->next2)
-                        *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
+                pc = in->next2;
+                VM_NEXT();
+            }
 
-                    s = s->next1;
-                } else {
-                    regex_log("Reverse character class \"%s\" did not match with character \"%c\" in string \n",
-                           s->data.cclass, *string);
-                    do_backtrack = 1;
-                }
-                break;
+            VM_SET(&bt->counts[pc], count);
+            VM_SET(&bt->loop_pos[pc], pos);
+
+            // Each copy the count needs starts a new epoch, the goes after it are the same copy again
+            if ((unsigned int) count < aq->min) {
+                VM_SET(&bt->epochs[in->arg + 1], ++bt->last_epoch);
+                pc = in->next1;
+            } else if ((unsigned int) count >= aq->max) {
+                pc = in->next2;
+            } else if (aq->lazy) {
+                VM_PUSH(in->next1);
+                pc = in->next2;
+            } else {
+                VM_PUSH(in->next2);
+                pc = in->next1;
+            }
+            VM_NEXT();
 
-            case S_CCLASS:
-                // If we get a match
-                if (match_ch_str(*string, s->data.cclass)) {
-                    regex_log("Character class \"%s\" matched with character \"%c\" in string \n",
-                           s->data.cclass, *string);
+        VM_CASE(OP_MATCH):
+            regex_log("Match completed!\n\n");
+            regex_trace(REGEX_TRACE_MATCH, pc, pos);
+            caps[1] = pos;
 
-                    capture_group_str_grab(cgd, *string);
-                    *sp++ = *string++;
-                    if (s->next2)
-                        *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
+            // Printing out the capturing groups for debugging
+            for (int i = 1; i < 10; i++)
+                regex_log("capture_group %d - %d to %d -\n", i, caps[2 * i], caps[2 * i + 1]);
+            regex_log("\n");
 
-                    s = s->next1;
-                } else {
-                    regex_log("Character class \"%s\" did not match with character \"%c\" in string \n",
-                           s->data.cclass, *string);
-                    do_backtrack = 1;
-                }
-                break;
+            return 1;
 
-            case S_META_CH:
-
-                switch (s->data.meta) {
-                    // Matches anything but the null character
-                    case M_ANY_CH:
-                        if (*string != '\0') {
-                            regex_log("Meta Character \".\" matched character \"%c\" in string \n", *string);
-
-                            capture_group_str_grab(cgd, *string);
-                            *sp++ = *string++;
-                            if (s->next2)
-                                *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
-
-                            s = s->next1;
-                        } else {
-                            regex_log("Meta Character \".\" did not match character \"%c\" in string \n", *string);
-                            do_backtrack = 1;
-                        }
-                        break;
-                    default:
-                        regex_log("Shouldn't hit this\n");
-                        return "";
-                }
+        default:
+            regex_log("Shouldn't hit this\n");
+            return 0;
+    }
 
-                break;
+    return 0;
+}
 
-            case S_LITERAL_CH:
-                if (s->data.ch == *string) {
-                    regex_log("Literal character \"%c\" matched character \"%c\" in string\n",
-                            s->data.ch, *string);
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_NEXT
+#undef VM_FAIL
+#undef VM_PUSH
+#undef VM_SET
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
 
-                    capture_group_str_grab(cgd, *string);
-                    *sp++ = *string++;
-                    if (s->next2)
-                        *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
-                    s = s->next1;
-                } else {
-                    // Backtracking would happen here
-                    regex_log("Literal character \"%c\" did not match character \"%c\" in string\n",
-                            s->data.ch, *string);
-                    do_backtrack = 1;
-                }
-                break;
+/**
+ * Bit-state memoization. Without back references or counters, where the machine can get to from
+ * a state only depends on the position, and the first time through already tried everything from
+ * there in priority order. So each (state, position) only needs trying once, which keeps the whole
+ * search to O(states * input) instead of exponential. The bits are kept between start offsets too,
+ * anything that failed from an earlier start fails from a later one. Only small enough inputs get it
+ */
+static void memo_setup(Regex *re, Backtracker *bt, int len) {
+    size_t bits = (size_t) re->n_states * (len + 1);
+    bt->memo = NULL;
+
+    if (!re->can_memoize || bits > MEMO_MAX_BITS)
+        return;
+
+    size_t words = (bits + 31) / 32;
+    if (words > bt->memo_size) {
+        free(bt->memo_bits);
+        bt->memo_size = words;
+        bt->memo_bits = malloc(sizeof(uint32_t) * words);
+
+        // It only makes things faster, so no room for it just means going without
+        if (bt->memo_bits == NULL) {
+            bt->memo_size = 0;
+            return;
+        }
+    }
 
-            // Specials
-            case S_FINAL:
-                regex_log("Match completed!\n\n");
-
-                // Printing out the capturing groups for debugging
-                for (int i = 0; i < 9; i++)
-                    regex_log("capture_group %d - %s -\n", i+1, cgd->cgs[i]);
-                regex_log("\n");
-                *sp++ = '\0';
-
-                // Cleanup
-                //free(backtrack_stack);
-                //free(cgd);
-                return rtn_str;
-            
-            case S_NODE:
-                regex_log("Node State, cg = %d, next1 = %p, next2 = %p\n",
-                    s->data.cg, (void *) s->next1, (void *) s->next2);
-                if (s->next2)
-                    *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
-                s = s->next1;
-                break;
+    memset(bt->memo_bits, 0, sizeof(uint32_t) * words);
+    bt->memo = bt->memo_bits;
+    bt->memo_stride = len + 1;
+}
 
-            case S_CG_NODE:
-                if (s->data.cg > 0) {
-                    // We only collect once, so "(abc)+" shouldn't result in "abcabc" etc for the capture string
-                    if (cgd->icg[s->data.cg - 1] == 0)
-                        cgd->icg[s->data.cg - 1] = 1;
-                } else if (s->data.cg < 0)
-                    // 2 let's us know that we've already been here
-                    cgd->icg[(s->data.cg * (-1)) - 1] = 2;
-
-                regex_log("Capture Group Node State, cg = %d, next1 = %p, next2 = %p\n",
-                    s->data.cg, (void *) s->next1, (void *) s->next2);
-                if (s->next2)
-                    *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
-                s = s->next1;
-                break;
+// Goes back to the last place there was another way to go. Returns 0 if there isn't one
+static int pop_backtrack(Backtracker *bt, uint32_t *pc, int *pos, int *caps) {
+    (void) caps; // Only the logging looks at them
+    regex_log("\nAttempting to backtrack\n");
 
-            case S_AQ_NODE:
-                s->data.aq.visited += 1;
-                if (s->data.aq.visited < s->data.aq.min) {
-                    // Laziness isn't implemented yet so we assume that next1 links back correctly
-                    // We don't store the backtracking data here because we are pretending next2
-                    // Doesn't go anywhere
-                    regex_log("Arbitrary Quantifier Node State, max = %u, min = %u, visited = %i ",
-                            s->data.aq.max, s->data.aq.min, s->data.aq.visited);
-                    regex_log("next1 = %p, next2 = %p\n", (void *) s->next1, (void *) s->next2);
-                    regex_log("Below minimum\n");
-                    s = (s->data.aq.lazy == 0) ? s->next1 : s->next2;
-
-                } else if (s->data.aq.visited > s->data.aq.max) {
-                    // If we go past we should backtrack
-                    regex_log("Arbitrary Quantifier Node State, max = %u, min = %u, visited = %i ",
-                            s->data.aq.max, s->data.aq.min, s->data.aq.visited);
-                    regex_log("next1 = %p, next2 = %p\n", (void *) s->next1, (void *) s->next2);
-                    regex_log("Went past maximum\n");
-                    do_backtrack = 1;
+    if (bt->n == 0) {
+        regex_log("Stack empty, unable to backtrack\n");
+        return 0;
+    }
 
-                } else {
-                    if (s->next2)
-                        *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
-                    s = s->next1;
-#if 0
-                    if (s->data.aq.lazy == 0) {
-                        if (s->next2)
-                            *btp++ = create_backtrack_data(string, sp, s->next2, cgd);
-                        s = s->next1;
-                    } else {
-                        if (s->next1)
-                            *btp++ = create_backtrack_data(string, sp, s->next1, cgd);
-                        s = s->next2;
-                    }
-#endif
-                }
-                break;
+    // Replacing relevant data
+    BacktrackData b = bt->stack[--bt->n];
+    bt->pops++;
+    regex_trace(REGEX_TRACE_POP, b.pc, b.pos);
+    *pos = b.pos;
+    *pc = b.pc;
+    regex_log("capture_group 1 before backtrack = %d to %d\n", caps[2], caps[3]);
 
-            default:
-                regex_log("Shouldn't hit this\n");
-                return "";
-        } // Switch
+    // Winding the captures back to how they were when this was pushed
+    wind_back(bt, b.undo);
 
-        if (do_backtrack) {
-            regex_log("\nAttempting to backtrack\n");
+    regex_log("Backtrack complete: Starting at instruction %u\n\n", *pc);
+    regex_log("capture_group 1 after backtrack = %d to %d\n", caps[2], caps[3]);
+    return 1;
+}
 
-            if (backtrack_stack == btp) {
-                regex_log("Stack empty, unable to backtrack\n");
-                return "";
-            } else {
-                // Replacing relevant data
-                b = *--btp;
-                string = b.string;
-                sp = b.sp;
-                s = b.s;
-                regex_log("capture_group 1 before backtrack = %s\n", cgd->cgs[0]);
-                *cgd = *b.cgd;
-
-                regex_log("Backtrack complete: Starting at state %p\n\n", (void *) s);
-                regex_log("capture_group 1 after backtrack = %s\n", cgd->cgs[0]);
-                do_backtrack = 0;
-            }
+/**
+ * Changes a capture slot or loop counter, keeping the old value so we can backtrack to it
+ * Returns 0 if there's no memory left to keep it in, the undo log is left as it was
+ */
+static int set_register(Backtracker *bt, int *reg, int value) {
+    if (bt->n_undo == bt->undo_size) {
+        CaptureUndo *undo = realloc(bt->undo, sizeof(CaptureUndo) * bt->undo_size * 2);
+        if (undo == NULL) {
+            regex_log("Out of memory for the undo log at %d entries\n", bt->n_undo);
+            return 0;
         }
-    } // While
+        bt->undo = undo;
+        bt->undo_size *= 2;
+    }
+
+    bt->undo[bt->n_undo].reg = reg;
+    bt->undo[bt->n_undo].old = *reg;
+    bt->n_undo++;
+    *reg = value;
+    return 1;
 }
 
-// Collects strings inside relevant capture groups
-static void capture_group_str_grab(CaptureGroupData *cgd, char ch) {
+// Puts the captures and counters back to how they were when the undo log was undo long
+static void wind_back(Backtracker *bt, int undo) {
+    while (bt->n_undo > undo) {
+        bt->n_undo--;
+        *bt->undo[bt->n_undo].reg = bt->undo[bt->n_undo].old;
+    }
+}
 
-    for (int i = 0; i < MAX_CAPTURE_GROUPS; i++) {
-        if (cgd->icg[i] == 1) {
-            cgd->cgs[i][cgd->str_ptrs[i]++] = ch;
-            cgd->cgs[i][cgd->str_ptrs[i]] = '\0';
+// Saves somewhere to come back to. Returns 0 if there's no memory left to grow the stack, it's left as it was
+static int push_backtrack(Backtracker *bt, uint32_t pc, int pos) {
+    if (bt->n == bt->size) {
+        BacktrackData *stack = realloc(bt->stack, sizeof(BacktrackData) * bt->size * 2);
+        if (stack == NULL) {
+            regex_log("Out of memory for the backtrack stack at %d entries\n", bt->n);
+            return 0;
         }
+        bt->stack = stack;
+        bt->size *= 2;
     }
+
+    bt->stack[bt->n].pc = pc;
+    bt->stack[bt->n].pos = pos;
+    bt->stack[bt->n].undo = bt->n_undo;
+    bt->n++;
+
+    bt->pushes++;
+    regex_trace(REGEX_TRACE_PUSH, pc, pos);
+    if (bt->n > bt->peak)
+        bt->peak = bt->n;
+    return 1;
 }
 
 
@@ -873,8 +1562,14 @@ static Fragment *link_fragments(Fragment *fp, char *sp) {
 }
 
 static State *create_state(StateType type, StateData data, State * const next1, State * const next2) {
-    State *a = malloc(sizeof(State));
-    *rfp++ = a;
+    Regex *re = compiling.re;
+    State *a = arena_alloc(re, sizeof(State));
+    if (re->n_states == re->states_size) {
+        re->states_size *= 2;
+        re->states = realloc(re->states, sizeof(State *) * re->states_size);
+    }
+    a->id = re->n_states;
+    re->states[re->n_states++] = a;
     a->type  = type;
     a->data  = data;
     a->next1 = next1;
@@ -890,6 +1585,159 @@ static Fragment create_fragment(State *s, StateList *l) {
     return rtn;
 }
 
+/**
+ * a{min,max}. When it's small enough it gets written out in full, a{2,4} turns into aa(a(a)?)?
+ * and a{2,} into aa+, which every engine can run as it is. Anything bigger goes round a counting
+ * loop instead so the machine stays small, only the backtracker knows how to count though.
+ * That's a cliff: past MAX_UNROLL_STATES the pattern loses the DFA, the pike VM and the memo,
+ * \d{1,1000}x runs at the DFA's speed and \d{1,5000}x an order of magnitude slower (see bench)
+ */
+static Fragment repeat_fragment(Fragment a, unsigned int min, unsigned int max, int lazy) {
+    StateData data = {.ch = '\0'};
+    unsigned int copies = (max == UINT_MAX) ? (min > 0 ? min : 1) : max;
+    FragmentCopier copier;
+
+    if ((unsigned long) copies * copier_init(&copier, a) > MAX_UNROLL_STATES) {
+        copier_free(&copier);
+        data.aq.min = min;
+        data.aq.max = max;
+        data.aq.lazy = lazy;
+
+        State *loop = create_state(S_AQ_NODE, data, a.start, NULL);
+        point_state_list(a.list, loop);
+        State *reset = create_state(S_AQ_RESET, (StateData) {.ch = '\0'}, loop, NULL);
+
+        return create_fragment(reset, create_state_list(&loop->next2));
+    }
+
+    Fragment rtn = create_fragment(NULL, NULL);
+
+    // Ways out of the optional copies, they all go to whatever comes after
+    StateList *skips = NULL;
+    if (max != UINT_MAX && max > min) {
+        skips = arena_alloc(compiling.re, sizeof(StateList) + sizeof(State **) * (max - min));
+        skips->n = 0;
+    }
+
+    for (unsigned int i = 0; i < copies; i++) {
+        // The copies are made before anything gets linked to a, the original goes last
+        Fragment copy = (i == copies - 1) ? a : clone_fragment(&copier);
+        State *start = copy.start;
+
+        if (max == UINT_MAX && i == copies - 1) {
+            // The last one loops like '+', or like '*' if it's the only one and it's optional
+            State *s = lazy ? create_state(S_NODE, data, NULL, copy.start)
+                            : create_state(S_NODE, data, copy.start, NULL);
+            point_state_list(copy.list, s);
+            copy.list = create_state_list(lazy ? &s->next1 : &s->next2);
+            if (min == 0)
+                start = s;
+
+        } else if (i >= min) {
+            // Past the minimum each one can be skipped, which skips the rest after it too
+            State *s = lazy ? create_state(S_NODE, data, NULL, copy.start)
+                            : create_state(S_NODE, data, copy.start, NULL);
+            skips->l[skips->n++] = lazy ? &s->next1 : &s->next2;
+            start = s;
+        }
+
+        if (rtn.start == NULL)
+            rtn.start = start;
+        else
+            point_state_list(rtn.list, start);
+        rtn.list = copy.list;
+    }
+
+    if (skips != NULL)
+        rtn.list = append_lists(skips, rtn.list);
+
+    copier_free(&copier);
+    return rtn;
+}
+
+/**
+ * Gets a fragment nothing has been linked to yet ready to be copied, returns how many states
+ * are in it. The ends haven't been pointed anywhere yet and nothing made after it points into
+ * it, so everything it can get to is part of it
+ */
+static int copier_init(FragmentCopier *c, Fragment a) {
+    Regex *re = compiling.re;
+    char *seen = calloc(re->n_states, sizeof(char));
+    State **stack = malloc(sizeof(State *) * (2 * re->n_states + 1));
+    State **sp = stack;
+
+    c->a = a;
+    c->states = malloc(sizeof(State *) * re->n_states);
+    c->index = malloc(sizeof(int) * re->n_states);
+    c->n = 0;
+
+    *sp++ = a.start;
+    while (sp != stack) {
+        State *s = *--sp;
+        if (seen[s->id])
+            continue;
+        seen[s->id] = 1;
+        c->index[s->id] = c->n;
+        c->states[c->n++] = s;
+
+        if (s->next1)
+            *sp++ = s->next1;
+        if (s->next2)
+            *sp++ = s->next2;
+    }
+
+    // The loose ends are at the same place in the copies as they are in a
+    c->ends = malloc(sizeof(int) * a.list->n);
+    for (int i = 0; i < a.list->n; i++) {
+        for (int j = 0; j < c->n; j++) {
+            if (a.list->l[i] == &c->states[j]->next1)
+                c->ends[i] = 2 * j;
+            else if (a.list->l[i] == &c->states[j]->next2)
+                c->ends[i] = 2 * j + 1;
+        }
+    }
+
+    free(seen);
+    free(stack);
+    return c->n;
+}
+
+// Makes a copy of every state in the fragment
+static Fragment clone_fragment(const FragmentCopier *c) {
+    Regex *re = compiling.re;
+    State **copies = malloc(sizeof(State *) * c->n);
+
+    for (int i = 0; i < c->n; i++) {
+        State *s = c->states[i];
+        copies[i] = create_state(s->type, s->data, s->next1, s->next2);
+    }
+
+    // Pointing the copies at each other instead of the originals
+    for (int i = 0; i < c->n; i++) {
+        if (copies[i]->next1)
+            copies[i]->next1 = copies[c->index[copies[i]->next1->id]];
+        if (copies[i]->next2)
+            copies[i]->next2 = copies[c->index[copies[i]->next2->id]];
+    }
+
+    StateList *l = arena_alloc(re, sizeof(StateList) + sizeof(State **) * c->a.list->n);
+    l->n = c->a.list->n;
+    for (int i = 0; i < l->n; i++) {
+        State *s = copies[c->ends[i] / 2];
+        l->l[i] = (c->ends[i] % 2) ? &s->next2 : &s->next1;
+    }
+
+    Fragment rtn = create_fragment(copies[0], l);
+    free(copies);
+    return rtn;
+}
+
+static void copier_free(FragmentCopier *c) {
+    free(c->states);
+    free(c->index);
+    free(c->ends);
+}
+
 // The pointers from the first fragment are pointed the the start of the next one
 static void point_state_list(StateList *l, State *a) {
     for (int i = 0; i < l->n; i++) {
@@ -898,8 +1746,7 @@ static void point_state_list(StateList *l, State *a) {
 }
 
 static StateList *create_state_list(State **first) {
-    StateList *l = malloc(sizeof(StateList));
-    *rfp++ = l;
+    StateList *l = arena_alloc(compiling.re, sizeof(StateList) + sizeof(State **));
     l->n = 0;
     l->l[l->n++] = first;
 
@@ -907,8 +1754,8 @@ static StateList *create_state_list(State **first) {
 }
 
 static StateList *append_lists(StateList *a, StateList *b) {
-    StateList *rtn = malloc(sizeof(StateList));
-    *rfp++ = rtn;
+    // Lists are never added to after they're made so they're only as big as they need to be
+    StateList *rtn = arena_alloc(compiling.re, sizeof(StateList) + sizeof(State **) * (a->n + b->n));
     rtn->n = 0;
 
     for (int i = 0; i < a->n; i++)
@@ -923,75 +1770,106 @@ static StateList *append_lists(StateList *a, StateList *b) {
 }
 
 
-static char *create_character_class(char *sp, StateData *data) {
-    data->cclass = malloc(sizeof(char) * MAX_STRING_SIZE);
-    *rfp++ = data->cclass;
-    char *cp = &data->cclass[0];
-    // @TODO: We don't look for backwards slashes right now
+/**
+ * Bump allocator for everything in the state machine. Things made one after the other while
+ * parsing end up next to each other in memory and the whole lot goes with one arena_free
+ */
+void *arena_alloc(Regex *re, size_t size) {
+    // Keeping everything aligned for whatever gets put in here
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    ArenaBlock *b = re->arena;
+    if (b == NULL || b->used + size > b->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(ArenaBlock) + block_size);
+        b->used = 0;
+        b->size = block_size;
+        b->next = re->arena;
+        re->arena = b;
+    }
+
+    void *rtn = &b->data[b->used];
+    b->used += size;
+    return rtn;
+}
+
+static void arena_free(Regex *re) {
+    while (re->arena != NULL) {
+        ArenaBlock *tmp = re->arena->next;
+        free(re->arena);
+        re->arena = tmp;
+    }
+}
+
+
+/**
+ * Fills c with everything up to the closing ']' and returns a pointer to it
+ * A '-' at the start or end, or straight after a range or a shorthand is just a '-'
+ */
+static char *create_character_class(char *sp, CharClass *c) {
+    memset(c, 0, sizeof(CharClass));
+    int last = -1; // The last character collected, -1 if a range can't start from here
+    int ch;
 
     while (*sp != ']') {
-        if (*sp == '-') {
-            if (*(sp - 1) != '\\'   // making sure it's not escaped
-             && *(sp - 1) != '['    // checking we aren't at the start
-             && peek_ch(sp) != '\\' // more escape checking
-             && peek_ch(sp) != ']'  // Checking we aren't at the end
-             && *(sp - 2) != '-') { // Making sure we aren't intruding on another range e.g A-Z-a
-                // We've already collected the first character
-                for (int i = *(sp - 1) + 1; i <= peek_ch(sp); i++)
-                    *cp++ = i;
+        if (*sp == '\\') {
+            const CharClass *shorthand = shorthand_class(peek_ch(sp));
 
+            // We can combine the classes together
+            if (shorthand != NULL) {
+                for (int i = 0; i < 8; i++)
+                    c->bits[i] |= shorthand->bits[i];
                 sp += 2;
-            } else {
-                *cp++ = *sp++;
+                last = -1;
+                continue;
             }
 
-        } else if (*sp == '\\') {
-            State *s = parse_escapes(&sp); // Utilizing parse_escapes
-            switch (s->type) {
-                case S_REVERSE_CCLASS:
-                    regex_log("reverse cclass\n");
-                    for (char i = 32; i < 127; i++) { // We skip the first lot that we definetly don't match
-                        if (match_ch_str(i, s->data.cclass) == 0) { // We take the char if it isn't in the string
-                            *cp++ = i;
-                        }
-                    }
-                    // Matching specific stuff we skipped
-                    if (match_ch_str(9 , s->data.cclass) == 0) *cp++ = 9;  // tabs
-                    if (match_ch_str(10, s->data.cclass) == 0) *cp++ = 10; // newline 
-                    if (match_ch_str(13, s->data.cclass) == 0) *cp++ = 13; // carriage return 
-
-                    sp++;
-                    break;
-
-                case S_CCLASS:
-                    // We can combine the classes together
-                    ;
-                    char *cclass_p = &s->data.cclass[0];
-                    while (*cclass_p != '\0') *cp++ = *cclass_p++;
-                    sp++;
-                    break;
-
-                case S_LITERAL_CH:
-                    *cp++ = s->data.ch;
-                    sp++;
-                    break;
-
-                default:
-                    regex_log("Unhandled state type \"%s\" in function %s\n",
-                           state_type_to_string(s->type), __func__);
-                    break;
-            }
+            ch = (unsigned char) escaped_ch(peek_ch(sp));
+            sp += 2;
+
+        } else if (*sp == '-' && last != -1 && peek_ch(sp) != ']' && peek_ch(sp) != '\\') {
+            // We've already collected the first character
+            for (int i = last + 1; i <= (unsigned char) peek_ch(sp); i++)
+                c->bits[i >> 5] |= 1u << (i & 31);
+
+            sp += 2;
+            last = -1;
+            continue;
+
+        } else {
+            ch = (unsigned char) *sp++;
         }
-        else // collect as normal
-        *cp++ = *sp++; 
-            
-    }
 
-    *cp++ = '\0';
+        c->bits[ch >> 5] |= 1u << (ch & 31);
+        last = ch;
+    }
 
     return sp;
 }
 
+// Returns the table for \d \w \s \D \W \S, or NULL if ch isn't one of them
+static const CharClass *shorthand_class(char ch) {
+    switch (ch) {
+        case 'd': return &digit_class;
+        case 'w': return &word_class;
+        case 's': return &space_class;
+        case 'D': return &not_digit_class;
+        case 'W': return &not_word_class;
+        case 'S': return &not_space_class;
+        default:  return NULL;
+    }
+}
+
+// What an escaped character turns into when it isn't anything special
+static char escaped_ch(char ch) {
+    switch (ch) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        default:  return ch;
+    }
+}
+
 static State *parse_escapes(char **p) {
     State *s;
     StateData data;
@@ -1021,64 +1899,19 @@ static State *parse_escapes(char **p) {
 
         // White space
         case 'n': case 't': case 'r':
-            data.ch = peek_ch(*p) == 'n' ? '\n' : peek_ch(*p) == 't' ? '\t' : '\r';
+            data.ch = escaped_ch(peek_ch(*p));
             s = create_state(S_LITERAL_CH, data, NULL, NULL);
             regex_log("State %p, Type = %s, ch = %c\n",
                     (void *) s, state_type_to_string(s->type), s->data.ch);
             (*p)++;
             break;
-            
-        case 'S':
-            create_character_class("\n\t\r ]", &data);
-            s = create_state(S_REVERSE_CCLASS, data, NULL, NULL);
-            regex_log("Shorthand \"\\s\" (NOT any whitespace character) Parsed\n");
-            regex_log("State %p, Type = %s, range = %s\n",
-                    (void *) s, state_type_to_string(s->type), s->data.cclass);
-            (*p)++;
-            break;
-
-        case 's':
-            create_character_class("\n\t\r ]", &data);
-            s = create_state(S_CCLASS, data, NULL, NULL);
-            regex_log("Shorthand \"\\s\" (Any whitespace character) Parsed\n");
-            regex_log("State %p, Type = %s, range = %s\n",
-                    (void *) s, state_type_to_string(s->type), s->data.cclass);
-            (*p)++;
-            break;
 
-        case 'D': // NOT any digit aka [0-9]
-            create_character_class("0-9]", &data);
-            s = create_state(S_REVERSE_CCLASS, data, NULL, NULL);
-            regex_log("Shorthand \"\\D\" (NOT any digit) Parsed\n");
-            regex_log("State %p, Type = %s, range = %s\n",
-                    (void *) s, state_type_to_string(s->type), s->data.cclass);
-            (*p)++;
-            break;
-
-        case 'd': // Any digit aka [0-9]
-            create_character_class("0-9]", &data);
+        // \d \w \s are [0-9] [A-Za-z0-9_] [\t\n\r ], the capital versions are the opposite
+        case 'd': case 'w': case 's': case 'D': case 'W': case 'S':
+            data.cclass = shorthand_class(peek_ch(*p));
             s = create_state(S_CCLASS, data, NULL, NULL);
-            regex_log("Shorthand \"\\d\" (any digit) Parsed\n");
-            regex_log("State %p, Type = %s, range = %s\n",
-                    (void *) s, state_type_to_string(s->type), s->data.cclass);
-            (*p)++;
-            break;
-
-        case 'W': // NOT any alphanumeric char and underscore aka [^A-Za-z0-9_]
-            create_character_class("A-Za-z0-9_]", &data);
-            s = create_state(S_REVERSE_CCLASS, data, NULL, NULL);
-            regex_log("Shorthand \"\\W\" (NOT any alphanum + underscore) Parsed\n");
-            regex_log("State %p, Type = %s, range = %s\n",
-                    (void *) s, state_type_to_string(s->type), s->data.cclass);
-            (*p)++;
-            break;
-
-        case 'w': // Any alphanumeric char and underscore aka [A-Za-z0-9_]
-            create_character_class("A-Za-z0-9_]", &data);
-            s = create_state(S_CCLASS, data, NULL, NULL);
-            regex_log("Shorthand \"\\w\" (any alphanum + underscore) Parsed\n");
-            regex_log("State %p, Type = %s, range = %s\n",
-                    (void *) s, state_type_to_string(s->type), s->data.cclass);
+            regex_log("Shorthand \"\\%c\" Parsed\n", peek_ch(*p));
+            regex_log("State %p, Type = %s\n", (void *) s, state_type_to_string(s->type));
             (*p)++;
             break;
 
@@ -1115,6 +1948,7 @@ static int get_arbitrary_quantifier(char **p, int *a, int *b) {
     char *str_ptr = &a_str[0];
 
     while (match_ch_str(*pp, "0123456789") == 1) *str_ptr++ = *pp++;
+    *str_ptr = '\0';
 
     if (*pp == '}') { // exact quantifier e.g {2}
         *a = atoi(a_str);
@@ -1132,6 +1966,7 @@ static int get_arbitrary_quantifier(char **p, int *a, int *b) {
             pp++;
             str_ptr = b_str;
             while (match_ch_str(*pp, "0123456789") == 1) *str_ptr++ = *pp++;
+            *str_ptr = '\0';
             if (*pp == '}') {
                 *a = atoi(a_str);
                 *b = atoi(b_str);
@@ -1150,26 +1985,29 @@ static int get_arbitrary_quantifier(char **p, int *a, int *b) {
 }
 
 
-static BacktrackData create_backtrack_data(char *string, char *sp, State *s, CaptureGroupData *cgd) {
-    BacktrackData rtn;
-    rtn.string = string;
-    rtn.sp = sp;
-    rtn.s = s;
+// Failed matches still hand back something the caller can free
+static char *empty_string(void) {
+    return calloc(1, sizeof(char));
+}
 
-    rtn.cgd = malloc(sizeof(CaptureGroupData));
-    *rfp++ = rtn.cgd;
-    *rtn.cgd = *cgd;
+static char *copy_substring(char *string, int start, int end) {
+    char *rtn = malloc(sizeof(char) * (end - start + 1));
+    memcpy(rtn, string + start, end - start);
+    rtn[end - start] = '\0';
     return rtn;
 }
 
-static char *state_type_to_string(StateType type) {
+char *state_type_to_string(StateType type) {
     switch (type) {
         case S_FINAL: return "S_FINAL";
         case S_NODE: return "S_NODE";
+        case S_CG_NODE: return "S_CG_NODE";
+        case S_AQ_NODE: return "S_AQ_NODE";
+        case S_AQ_RESET: return "S_AQ_RESET";
         case S_LITERAL_CH: return "S_LITERAL_CH";
+        case S_LITERAL_STR: return "S_LITERAL_STR";
         case S_META_CH: return "S_META_CH";
         case S_CCLASS: return "S_CCLASS";
-        case S_REVERSE_CCLASS: return "S_REVERSE_CCLASS";
         case S_BACK_REFERENCE: return "S_BACK_REFERENCE";
         default: return "Unhandled case in state_type_to_string";
     }
@@ -1228,18 +2066,47 @@ static void pattern_error(char *p, unsigned int pos, unsigned int range, char *m
     va_end(args);
 }
 
+#ifdef REGEX_DEBUG
 // Let's us easily suppress printing to the screen probably temporary
-static void regex_log(char *msg, ...) {
-    if (options.suppress_logging) return;
+void regex_log(char *msg, ...) {
+    if (!logging) return;
 
     va_list args;
     va_start(args, msg);
     vprintf(msg, args);
     va_end(args);
 }
+#endif
 
 // Some options can be handled as soon as we enter the function
-static void handle_options(unsigned int opts) {
+static Options handle_options(unsigned int opts) {
+    Options options;
     options.suppress_logging = (opts & REGEX_SUPPRESS_LOGGING) ? 1 : 0;
     options.start_of_string = 0;
+    options.backtrack = (opts & REGEX_BACKTRACK) ? 1 : 0;
+
+#ifdef REGEX_DEBUG
+    logging = !options.suppress_logging;
+#endif
+    return options;
+}
+
+// Logging follows whichever pattern this thread is matching with
+static void use_options(const Regex *re) {
+#ifdef REGEX_DEBUG
+    logging = !re->options.suppress_logging;
+#endif
+
+    if (match_stats != NULL)
+        match_stats->memory = regex_footprint(re);
+}
+
+// Everything a compiled pattern has allocated, not counting any thread's scratch space
+static size_t regex_footprint(const Regex *re) {
+    size_t size = sizeof(Regex) + sizeof(State *) * re->states_size;
+
+    for (const ArenaBlock *b = re->arena; b != NULL; b = b->next)
+        size += sizeof(ArenaBlock) + b->size;
+
+    return size;
 }
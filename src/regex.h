@@ -1,10 +1,210 @@
 #ifndef REGEX_H
 #define REGEX_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 /***** Exported Defines *****/
 #define REGEX_SUPPRESS_LOGGING 1 << 0
+#define REGEX_BACKTRACK        1 << 1 // Use the backtracking engine even if the pike VM could do it, unless
+                                      // the input's too big for it to remember where it's been
+#define REGEX_MAX_GROUPS       99     // The most capture groups a pattern can have
+
+
+/***** Exported Datatypes *****/
+/**
+ * A compiled pattern. Build it once with regex_compile and run it against as many strings as you like
+ * It never changes once it's compiled, so any number of threads can match with the same one at once
+ */
+typedef struct Regex_ Regex;
+// Lots of patterns compiled together so they can all be checked against a string in one go
+typedef struct RegexSet_ RegexSet;
+// Matches a pattern against input that turns up a chunk at a time
+typedef struct RegexStream_ RegexStream;
+
+// A piece of input that doesn't have to be NUL terminated
+typedef struct RegexInput_ {
+    const char *string;
+    size_t len;
+} RegexInput;
+
+/**
+ * Walks through every match in a string, one regex_iter_next at a time. Set it up with regex_iter_init
+ * It's only a place in the input so it can live on the stack, nothing gets allocated while it runs
+ */
+typedef struct RegexIter_ {
+    Regex *re;
+    const char *string;
+    size_t len;
+    size_t pos; // Where the search for the next match starts
+} RegexIter;
+
+/**
+ * What the engines got up to, for working out why a pattern is slow without turning logging on
+ * Everything adds up over every match this thread does between regex_stats_start and regex_stats_stop
+ */
+typedef struct RegexStats_ {
+    unsigned long long calls;           // Calls to the match functions
+    unsigned long long bytes;           // Input handed to them
+    unsigned long long states;          // States stepped through, for the DFA that's one per byte it moved on
+    unsigned long long starts;          // Offsets the backtracker or the pike VM tried a match from
+    unsigned long long prefilter_skips; // Bytes skipped over because a match couldn't start there
+    unsigned long long pushes;          // Backtrack stack pushes
+    unsigned long long pops;            // Going back to try something else
+    unsigned long long peak_depth;      // Deepest the backtrack stack got
+    unsigned long long dfa_hits;        // DFA transitions that were already cached
+    unsigned long long dfa_misses;      // DFA transitions that had to be worked out
+    unsigned long long dfa_flushes;     // Times the DFA cache filled up and got thrown away
+    size_t memory;     // Size of the compiled pattern the last call used
+    size_t dfa_memory; // How much the DFA cache had in it at the end of the last call that used it
+} RegexStats;
+
+// How the cache of patterns behind regex() is doing
+typedef struct RegexCacheStats_ {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    int entries; // Patterns in it right now
+} RegexCacheStats;
+
+// What happened in a RegexTraceEvent
+typedef enum {
+    REGEX_TRACE_START = 1, // Trying for a match from pos
+    REGEX_TRACE_STEP,      // At state with pos the next byte
+    REGEX_TRACE_PUSH,      // The backtracker saved state at pos to come back to
+    REGEX_TRACE_POP,       // and came back to it
+    REGEX_TRACE_MEMO,      // The backtracker had already tried state at pos, or got back to it without reading anything
+    REGEX_TRACE_MATCH,     // A match ended at pos
+    REGEX_TRACE_SKIP,      // Nothing could start before pos, state is where the skip started
+    REGEX_TRACE_DFA_MISS,  // The DFA worked out a transition at pos, state is how many states it has cached
+    REGEX_TRACE_DFA_FLUSH, // The DFA cache was full at pos and got thrown away
+} RegexTraceKind;
+
+// 8 bytes each so a few million of them don't take up much room
+typedef struct RegexTraceEvent_ {
+    unsigned int pos;
+    unsigned int state : 28;
+    unsigned int kind  : 4;
+} RegexTraceEvent;
 
+/**
+ * A ring buffer of what the engines did, filled between regex_trace_start and regex_trace_stop
+ * Only the last size events are kept, n is how many there were altogether
+ */
+typedef struct RegexTrace_ {
+    RegexTraceEvent *events;
+    size_t size; // A power of two
+    unsigned long long n;
+} RegexTrace;
 
+/**
+ * Gets called with every match a RegexStream finds. caps[2g] and caps[2g + 1] are where capture group g
+ * starts and ends (0 is the whole match), counted from the start of the stream, -1 if it didn't match
+ */
+typedef void (*RegexStreamFn)(const long long *caps, int n_groups, void *data);
+
+
+/***** Exported Functions *****/
+/**
+ * Compiles and matches in one go. The returned string is freed by the caller
+ * The last few patterns get kept compiled (by pattern and options), so calling it again with the
+ * same one skips compiling it. Safe to call from any number of threads
+ */
 char *regex(char *pattern, char *string, unsigned int options);
+void regex_cache_stats(RegexCacheStats *stats);
+// Frees every pattern regex() has kept and starts the counts again
+void regex_cache_clear(void);
+
+// Returns NULL if the pattern is badly formed or has more than REGEX_MAX_GROUPS capture groups
+Regex *regex_compile(char *pattern, unsigned int options);
+// Returns the first match in string, or "" if there isn't one. The returned string is freed by the caller
+char *regex_exec(Regex *re, char *string);
+// Returns what capture group number group matched (0 is the whole match), or "" if it didn't match
+char *regex_group(Regex *re, char *string, int group);
+/**
+ * Finds the first match in string without copying anything or allocating. string is len bytes of anything,
+ * it doesn't need a NUL on the end and can have '\0's in it (up to INT_MAX bytes get looked at)
+ * caps needs room for 2 * (regex_group_count + 1), caps[2g] and caps[2g + 1] are where group g starts
+ * and ends as offsets into string, -1 if it didn't match. Returns 1 if there was a match
+ * No pattern has more than REGEX_MAX_GROUPS groups, so 2 * (REGEX_MAX_GROUPS + 1) is always enough
+ */
+int regex_find(Regex *re, const char *string, size_t len, long long *caps);
+// How many capture groups the pattern has, not counting the whole match
+int regex_group_count(Regex *re);
+// Returns 1 if string contains a match. Uses a lazily built DFA so it's a lot quicker than regex_exec
+int regex_match(Regex *re, char *string);
+// regex_match on len bytes that don't need a NUL on the end (up to INT_MAX bytes get looked at)
+int regex_match_len(Regex *re, const char *string, size_t len);
+/**
+ * Same answer as regex_match, for one big buffer that doesn't need to be NUL terminated. The buffer gets
+ * split between n_threads threads (one per core is what you want), each with a DFA of its own
+ * Patterns that need the backtracker can't be split up so they run on this thread, up to INT_MAX bytes
+ */
+int regex_match_parallel(Regex *re, const char *string, size_t len, int n_threads);
+/**
+ * regex_match for lots of short inputs at once, results[i] is 1 if inputs[i] has a match (each up to INT_MAX bytes)
+ * A few inputs go through the DFA side by side, and with n_threads > 1 the inputs get shared out between threads
+ * Patterns that need the backtracker go through one input at a time on this thread
+ */
+void regex_match_batch(Regex *re, const RegexInput *inputs, int n, int *results, int n_threads);
+// How much memory the DFA behind regex_match can use for its state cache (default 1MB, for each thread)
+// Set it before any other threads start using re
+void regex_set_dfa_memory(Regex *re, size_t bytes);
+void regex_free(Regex *re);
+
+/**
+ * Zeroes stats and starts adding to it from every match function this thread calls, with any pattern
+ * Cheap enough to leave on, but it's meant for sampling the odd call. One at a time on each thread
+ */
+void regex_stats_start(RegexStats *stats);
+// Stops adding to it, whatever it collected stays there
+void regex_stats_stop(void);
+
+/**
+ * Has every match function this thread calls put what it's doing in events (size of them, rounded down
+ * to a power of two), overwriting the oldest once it's full. Nothing gets printed while it runs
+ * Returns 0 and does nothing if the library was built without REGEX_DEBUG
+ */
+int regex_trace_start(RegexTrace *trace, RegexTraceEvent *events, size_t size);
+void regex_trace_stop(void);
+// Writes the events still in trace out as text, oldest first. re is the pattern they came from
+void regex_trace_print(const RegexTrace *trace, Regex *re, FILE *f);
+
+// Gets it ready to find the matches in string, which doesn't have to be NUL terminated
+void regex_iter_init(RegexIter *it, Regex *re, const char *string, size_t len);
+/**
+ * Finds the next match, starting where the last one ended. caps needs room for 2 * (regex_group_count + 1),
+ * caps[2g] and caps[2g + 1] are where group g starts and ends counted from the start of string, -1 if it
+ * didn't match. Returns 0 once there aren't any more (or nothing within INT_MAX bytes of the last match)
+ * Matches never overlap, and since empty matches don't count it always moves forward
+ */
+int regex_iter_next(RegexIter *it, long long *caps);
+
+// Returns NULL if any of the patterns are badly formed or have more than REGEX_MAX_GROUPS capture groups
+RegexSet *regex_set_compile(char **patterns, int n, unsigned int options);
+/**
+ * Puts the index of every pattern that matches somewhere in string into ids, smallest first
+ * Returns how many there were. ids needs room for every pattern in the set
+ */
+int regex_set_match(RegexSet *set, char *string, int *ids);
+// Same as regex_set_dfa_memory but for the DFA behind a set (default 1MB for every 32 patterns)
+void regex_set_memory(RegexSet *set, size_t bytes);
+void regex_set_free(RegexSet *set);
+
+/**
+ * Matches are reported through fn as soon as nothing later in the stream could change them, then
+ * matching carries on from the end of the match. Only the input after the end of a match that's
+ * waiting to be reported is kept, however far back the match started. A match still being looked
+ * for can go on for up to INT_MAX bytes
+ * Returns NULL if the pattern needs the backtracker (back references and big {n,m}) or was compiled with
+ * REGEX_BACKTRACK, those can't be streamed
+ */
+RegexStream *regex_stream_open(Regex *re, RegexStreamFn fn, void *data);
+void regex_stream_feed(RegexStream *st, const char *chunk, size_t len);
+// No more input is coming, finishes off anything that was waiting to see what came next
+void regex_stream_end(RegexStream *st);
+// How much memory the stream is holding on to input in
+size_t regex_stream_buffered(const RegexStream *st);
+void regex_stream_free(RegexStream *st);
 
 #endif
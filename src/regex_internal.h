@@ -0,0 +1,361 @@
+#ifndef REGEX_INTERNAL_H
+#define REGEX_INTERNAL_H
+
+/**
+ * Stuff shared between the parser and the different matching engines
+ * Nothing in here is part of the exported interface
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "regex.h"
+
+
+
+/***** Defines *****/
+#define MAX_STACK_SIZE     64
+#define MAX_STRING_SIZE    256
+#define STREAM_MIN_BUFFER  64        // Where a RegexStream's buffer starts once it has something to keep
+#define MAX_CAPTURE_GROUPS (REGEX_MAX_GROUPS + 1) // Group 0 is the whole match
+#define DFA_DEFAULT_MEMORY (1 << 20)
+#define DFA_SET_PATTERNS   32 // How many patterns in a set get DFA_DEFAULT_MEMORY
+#define ARENA_BLOCK_SIZE   4096
+#define ARENA_ALIGN        _Alignof(max_align_t)
+#define PARALLEL_MIN_CHUNK (1 << 16) // Anything smaller isn't worth a thread
+#define PARALLEL_MAX_CHUNK (1 << 30) // Offsets inside a chunk have to fit in an int
+#define PARALLEL_BATCH_SIZE 256      // How many inputs a thread takes from a batch at a time
+#define SCRATCH_SLOTS      8         // How many patterns each thread keeps scratch space for
+#define MEMO_MAX_BITS      (1 << 20) // Biggest states x input the backtracker keeps a visited bit for (128KB)
+#define MAX_UNROLL_STATES  4096      // {n,m} that would need more states than this when written out gets a counting loop, see repeat_fragment
+#define CACHE_SHARDS       16        // regex()'s pattern cache is split up so threads don't all want the same lock
+#define CACHE_SHARD_SIZE   8         // Patterns each shard keeps
+
+#define NO_INST            UINT32_MAX // An instruction with only one way to go has this as next2
+
+// Transitions out of dfa_build that don't go to another state
+#define DFA_TO_MATCH       -1 // Found a match
+#define DFA_TO_DEAD        -2 // Nothing can match any more
+
+// GCC and clang can jump straight from one instruction's code to the next, see perform_regex
+#if defined(__GNUC__) && !defined(REGEX_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+#define EXACT_QUANTIFIER     -1
+#define OPEN_ENDED_QUANTIFIER -2
+
+
+/***** Datatypes *****/
+/**
+ * Short_hands aren't included in StateType because they should get converted to something else
+ * e.g \w get's changed to a character class matching [a-zA-Z0-9_]
+ */
+typedef enum {
+    M_ANY_CH = 1, // .
+} MetaChType;
+
+// For the counting loops {n,m} turns into when it's too big to write out, max is UINT_MAX for {n,}
+typedef struct AQData_ {
+    unsigned int max;
+    unsigned int min;
+             int lazy;
+} AQData;
+
+typedef enum {
+    // Special States
+    S_FINAL = 1,
+    S_NODE,
+    S_CG_NODE, // Store capture group data
+    S_AQ_NODE,  // Counting loop, next1 goes round again and next2 leaves. Only the backtracker runs these
+    S_AQ_RESET, // On the way into a counting loop (next1), starts its count again
+
+    // Normal States
+    S_LITERAL_CH,
+    S_LITERAL_STR, // A run of literals joined together, see optimize.c. Only the backtracker runs these
+    S_META_CH,
+    S_CCLASS, // [^...] gets flipped when it's compiled so there's no reverse version
+    S_BACK_REFERENCE,
+} StateType;
+
+// One bit per byte value, so checking a character is a single bit test
+typedef struct CharClass_ {
+    uint32_t bits[8];
+} CharClass;
+
+// For S_LITERAL_STR, the bytes live in the arena
+typedef struct LiteralData_ {
+    const unsigned char *str;
+    int len;
+} LiteralData;
+
+typedef union StateData_ {
+    unsigned char ch; // for literal characters
+    MetaChType meta; // Meta character types
+    const struct CharClass_ *cclass; // Either in the arena or one of the shorthand tables
+    char cg; // capture group number - negative number means we are leaving the group
+    struct AQData_ aq;
+    struct LiteralData_ lit;
+    int pattern; // For S_FINAL in a RegexSet, which pattern just matched
+} StateData;
+
+typedef struct State_ {
+    StateType type;
+
+    union StateData_ data;
+
+    struct State_ *next1;
+    struct State_ *next2;
+
+    int id; // Index into Regex.states, used by the engines that keep sets of states
+} State;
+
+
+typedef struct StateList_ {
+    int n;
+    struct State_ **l[]; // Sized when it's made
+} StateList;
+
+// Fragments of the state machine
+typedef struct Fragment_ {
+    struct State_ *start;
+    struct StateList_ *list;
+} Fragment;
+
+// One block of the arena a compiled pattern lives in
+typedef struct ArenaBlock_ {
+    struct ArenaBlock_ *next;
+    size_t used;
+    size_t size;
+    _Alignas(max_align_t) char data[];
+} ArenaBlock;
+
+typedef enum {
+    SCAN_NONE = 0, // Could start with anything, every offset gets tried
+    SCAN_NOTHING,  // Can't match anything that isn't empty
+    SCAN_MEMCHR,
+    SCAN_BYTES,    // 2 or 3 bytes
+    SCAN_CLASS,
+} ScanType;
+
+// The bytes a match can start with, and what scan_first needs to look for them quickly
+typedef struct FirstBytes_ {
+    ScanType type;
+    struct CharClass_ set;
+    unsigned char bytes[3];
+    unsigned char lo_clear[16]; // Nibble shuffle tables, see scan_compile
+    unsigned char lo_set[16];
+} FirstBytes;
+
+// What an instruction in a Program does. Contiguous from 0 so they can index a jump table
+typedef enum {
+    OP_CHAR,        // ch
+    OP_STR,         // len bytes from bytes[arg]
+    OP_ANY,         // .
+    OP_CLASS,       // classes[arg]
+    OP_SPLIT,       // next1 first, next2 if that doesn't work out
+    OP_GROUP_START, // arg is the capture group
+    OP_GROUP_END,
+    OP_BACKREF,     // arg is the capture group
+    OP_LOOP_RESET,  // next1 is the loop
+    OP_LOOP,        // loops[arg], next1 goes round again and next2 leaves
+    OP_MATCH,       // arg is the pattern, for sets
+    OP_COUNT,
+} Opcode;
+
+// 16 bytes, so four of them share a cache line
+typedef struct Inst_ {
+    uint8_t op;
+    uint8_t ch;
+    uint16_t len; // Runs get split up in optimize.c so they fit
+    uint32_t next1;
+    uint32_t next2;
+    uint32_t arg;
+} Inst;
+
+/**
+ * The state machine flattened out into one block so the engines don't chase pointers round the heap
+ * Instruction i is state i, so the ids the engines keep sets of and trace are the same either way
+ */
+typedef struct Program_ {
+    Inst *insts;
+    int n;
+    struct CharClass_ *classes;
+    struct AQData_ *loops;
+    int n_loops;
+    unsigned char *bytes;
+    size_t size; // Of the whole block
+
+    /**
+     * Without the memo the backtracker has to notice for itself when it's got back to an
+     * instruction without reading anything, or a loop round something empty never ends.
+     * 0 for the instructions that can't. The rest remember where they were last run, which only
+     * counts while the same epoch is still going: 1 is the one outside every counting loop and
+     * 2 + i the one for loops[i], the innermost counting loop they're in. See perform_regex
+     */
+    uint32_t *cycles;
+} Program;
+
+// One of the patterns joined together in a RegexSet
+typedef struct SetPattern_ {
+    struct State_ *start;
+    int anchored; // Started with '^', so it only gets a go at offset 0
+} SetPattern;
+
+typedef struct Options_ {
+    unsigned int suppress_logging : 1;
+    unsigned int start_of_string  : 1; // When the '^' is used at the start of the string
+    unsigned int backtrack        : 1; // Force the backtracking engine
+} Options;
+
+/**
+ * A compiled pattern, built once by regex_compile and reused by regex_exec
+ * Nothing in here changes once it's compiled (apart from regex_set_dfa_memory), so threads can share it
+ */
+struct Regex_ {
+    State *start;
+    Options options;
+    unsigned long serial; // Unique to this Regex, finds its Scratch
+
+    // Every state in the graph by id, for the passes that go over all of them. program.c makes state i instruction i
+    State **states;
+    int n_states;
+    int states_size;
+    int n_groups;
+
+    // Back references and arbitrary quantifiers need the backtracking engine
+    int needs_backtrack;
+    // Nothing but the position decides where a state can get to, so the backtracker can memoize
+    int can_memoize;
+
+    // What the engines actually run, made from the states once they're finished with (see program.c)
+    Program prog;
+
+    // Lets the engines skip offsets where a match can't start
+    FirstBytes first;
+
+    // Only for the machine behind a RegexSet, each pattern hangs off start with its own S_FINAL
+    struct SetPattern_ *set;
+    int n_set;
+
+    // How big each thread's lazy DFA state cache is allowed to get
+    size_t dfa_mem_limit;
+
+    // Everything made while compiling lives in here, freed in one go by regex_free
+    struct ArenaBlock_ *arena;
+};
+
+/**
+ * Every pattern the DFA can handle goes in one machine, so one pass over the input checks
+ * all of them. Anything that needs the backtracker gets compiled on its own instead
+ */
+struct RegexSet_ {
+    Regex *re; // NULL if every pattern needed the backtracker
+    Regex **single; // NULL for the patterns that are in re
+    int n;
+};
+
+/**
+ * Everything the engines write to while matching, so the Regex itself never changes
+ * Every thread has its own for each pattern it's using, see scratch.c. Each part is
+ * allocated the first time an engine needs it
+ */
+typedef struct Scratch_ {
+    unsigned long serial; // Which Regex it belongs to
+    struct PikeData_ *pike;
+    struct Backtracker_ *backtracker;
+    struct DfaData_ *dfa;
+} Scratch;
+
+// One pattern in regex()'s cache, only cache.c looks inside it
+struct CacheEntry_;
+
+
+/***** Function Prototypes *****/
+// cache.c
+Regex *cache_get(char *pattern, unsigned int opts, struct CacheEntry_ **entry);
+void cache_release(struct CacheEntry_ *e);
+
+// dfa.c
+int dfa_exec(Regex *re, const char *string, int len);
+int dfa_exec_set(Regex *re, const char *string, int len, int *matched);
+int dfa_exec_chunk(Regex *re, struct DfaData_ *dd, const int *ids, int n, const char *string, int len,
+        int *end_ids, int *n_end);
+struct DfaData_ *dfa_create(Regex *re, int new_starts);
+int dfa_start_ids(const struct DfaData_ *dd, const int **ids);
+void dfa_destroy(struct DfaData_ *dd);
+void dfa_exec_batch(Regex *re, struct DfaData_ *dd, const RegexInput *inputs, int n, int *results);
+int dfa_build(Regex *re, int whole, int max_states, int **next, int **accepts);
+
+// optimize.c
+void optimize_states(Regex *re, int fuse);
+
+// program.c
+void program_compile(Regex *re);
+
+// parallel.c
+int parallel_exec(Regex *re, const char *string, size_t len, int n_threads);
+void parallel_batch(Regex *re, const RegexInput *inputs, int n, int *results, int n_threads);
+
+// scan.c
+void scan_compile(Regex *re);
+int scan_first(const Regex *re, const char *string, int pos, int len);
+
+// pike.c
+int pike_exec(Regex *re, const char *string, int len, int *caps);
+void pike_free(struct PikeData_ *pd);
+
+// scratch.c
+Scratch *regex_scratch(const Regex *re);
+void scratch_release(const Regex *re);
+unsigned long scratch_serial(void);
+
+// regex.c
+char *state_type_to_string(StateType type);
+void *arena_alloc(Regex *re, size_t size);
+void backtracker_free(struct Backtracker_ *bt);
+void stats_merge(RegexStats *into, const RegexStats *from);
+
+// Where the engines add up what they did, NULL unless somebody on this thread called regex_stats_start
+extern _Thread_local RegexStats *match_stats;
+
+/**
+ * Logging and tracing only get built with REGEX_DEBUG. Without it they go away completely,
+ * arguments and all, so they don't cost anything on the paths that call them every step
+ */
+#ifdef REGEX_DEBUG
+void regex_log(char *msg, ...);
+
+// trace.c
+extern _Thread_local RegexTrace *match_trace;
+
+// Puts an event in this thread's trace, if it has one going
+static inline void regex_trace(RegexTraceKind kind, int state, int pos) {
+    RegexTrace *t = match_trace;
+    if (t != NULL) {
+        RegexTraceEvent *e = &t->events[t->n++ & (t->size - 1)];
+        e->pos = (unsigned int) pos;
+        e->state = (unsigned int) state;
+        e->kind = kind;
+    }
+}
+#else
+#define regex_log(...) ((void) 0)
+#define regex_trace(kind, state, pos) ((void) 0)
+#endif
+
+
+// Every call to one of the match functions counts its input once
+static inline void stats_input(size_t len) {
+    if (match_stats != NULL) {
+        match_stats->calls++;
+        match_stats->bytes += len;
+    }
+}
+
+
+static inline int cclass_has(const CharClass *c, unsigned char ch) {
+    return (c->bits[ch >> 5] >> (ch & 31)) & 1;
+}
+
+#endif
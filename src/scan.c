@@ -0,0 +1,257 @@
+/**
+ * First byte scanning - skips over the parts of the input where a match can't start.
+ *
+ * Every match that isn't empty has to start with a byte that one of the states at the start
+ * of the machine can consume, so that set is worked out once when the pattern is compiled
+ * and the engines jump straight to the next offset holding one of those bytes.
+ * Empty matches don't count (see regex_exec) so the paths that get to S_FINAL without
+ * consuming anything don't add to the set.
+ *
+ * How we look depends on how big the set is:
+ *  - 1 byte is just memchr
+ *  - 2 or 3 bytes get compared 16 at a time with SSE2
+ *  - Anything bigger uses a nibble shuffle on 32 bytes at a time with AVX2 if the CPU has it
+ * Otherwise (and for the bits left over at the end) it's a plain loop over the bitmap
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_HAVE_AVX2 1
+#endif
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Function Prototypes *****/
+void scan_compile(Regex *re);
+int scan_first(const Regex *re, const char *string, int pos, int len);
+static int scan_next(const Regex *re, const char *string, int pos, int len);
+
+static const unsigned char *scan_bytes(const FirstBytes *f, const unsigned char *p, const unsigned char *end);
+static const unsigned char *scan_class(const FirstBytes *f, const unsigned char *p, const unsigned char *end);
+#ifdef SCAN_HAVE_AVX2
+static const unsigned char *scan_class_avx2(const FirstBytes *f, const unsigned char *p, const unsigned char *end);
+#endif
+
+
+
+// Works out re->first from the states at the start of the machine
+void scan_compile(Regex *re) {
+    FirstBytes *f = &re->first;
+    memset(f, 0, sizeof(FirstBytes));
+    f->type = SCAN_NONE;
+
+    // Only offset 0 gets tried so there's nothing to skip
+    if (re->options.start_of_string)
+        return;
+
+    char *seen = calloc(re->n_states, sizeof(char));
+    State **stack = malloc(sizeof(State *) * (2 * re->n_states + 1));
+    State **sp = stack;
+    int everything = 0;
+    *sp++ = re->start;
+
+    while (sp != stack && !everything) {
+        State *s = *--sp;
+        if (seen[s->id])
+            continue;
+        seen[s->id] = 1;
+
+        switch (s->type) {
+            // The counting loops could go either way depending on the count so we follow both
+            case S_NODE: case S_CG_NODE: case S_AQ_NODE: case S_AQ_RESET:
+                if (s->next2)
+                    *sp++ = s->next2;
+                *sp++ = s->next1;
+                break;
+
+            case S_FINAL:
+                break;
+
+            case S_LITERAL_CH:
+                f->set.bits[s->data.ch >> 5] |= 1u << (s->data.ch & 31);
+                break;
+
+            case S_LITERAL_STR:
+                f->set.bits[s->data.lit.str[0] >> 5] |= 1u << (s->data.lit.str[0] & 31);
+                break;
+
+            case S_CCLASS:
+                for (int i = 0; i < 8; i++)
+                    f->set.bits[i] |= s->data.cclass->bits[i];
+                break;
+
+            // '.' and back references could start with anything
+            default:
+                everything = 1;
+                break;
+        }
+    }
+
+    free(seen);
+    free(stack);
+
+    if (everything)
+        return;
+
+    int n = 0;
+    for (int i = 0; i < 256; i++) {
+        if (!cclass_has(&f->set, i))
+            continue;
+        if (n < 3)
+            f->bytes[n] = i;
+        n++;
+    }
+
+    if (n == 0) {
+        f->type = SCAN_NOTHING;
+    } else if (n == 1) {
+        f->type = SCAN_MEMCHR;
+    } else if (n <= 3) {
+        // With only 2 the last one gets doubled up so scan_bytes doesn't need to care
+        if (n == 2)
+            f->bytes[2] = f->bytes[1];
+        f->type = SCAN_BYTES;
+    } else if (n < 256) {
+        /**
+         * Tables for the nibble shuffle. For a byte b, lo_clear[b & 15] has bit (b >> 4) set
+         * if b is in the set, for b < 128. lo_set is the same for b >= 128
+         */
+        for (int i = 0; i < 256; i++) {
+            if (!cclass_has(&f->set, i))
+                continue;
+            if (i < 128)
+                f->lo_clear[i & 15] |= 1 << (i >> 4);
+            else
+                f->lo_set[i & 15] |= 1 << ((i >> 4) & 7);
+        }
+        f->type = SCAN_CLASS;
+    }
+
+    regex_log("First byte set has %d bytes, scan type %d\n", n, f->type);
+}
+
+/**
+ * Returns the first offset from pos onwards where a match could start, or len if there isn't one
+ * Always returns pos if the pattern could start with anything
+ */
+int scan_first(const Regex *re, const char *string, int pos, int len) {
+    int next = scan_next(re, string, pos, len);
+
+    if (next > pos) {
+        if (match_stats != NULL)
+            match_stats->prefilter_skips += next - pos;
+        regex_trace(REGEX_TRACE_SKIP, pos, next);
+    }
+    return next;
+}
+
+// The actual search, scan_first only adds counting what got skipped
+static int scan_next(const Regex *re, const char *string, int pos, int len) {
+    const FirstBytes *f = &re->first;
+    const unsigned char *p = (const unsigned char *) string + pos;
+    const unsigned char *end = (const unsigned char *) string + len;
+
+    if (pos >= len)
+        return len;
+
+    switch (f->type) {
+        case SCAN_NONE:
+            return pos;
+
+        case SCAN_NOTHING:
+            return len;
+
+        case SCAN_MEMCHR:
+            p = memchr(p, f->bytes[0], end - p);
+            return (p != NULL) ? (int) (p - (const unsigned char *) string) : len;
+
+        case SCAN_BYTES:
+            p = scan_bytes(f, p, end);
+            break;
+
+        case SCAN_CLASS:
+            p = scan_class(f, p, end);
+            break;
+    }
+
+    return (int) (p - (const unsigned char *) string);
+}
+
+// memchr but for 2 or 3 bytes at once
+static const unsigned char *scan_bytes(const FirstBytes *f, const unsigned char *p, const unsigned char *end) {
+#ifdef __SSE2__
+    __m128i a = _mm_set1_epi8((char) f->bytes[0]);
+    __m128i b = _mm_set1_epi8((char) f->bytes[1]);
+    __m128i c = _mm_set1_epi8((char) f->bytes[2]);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+                _mm_cmpeq_epi8(v, c));
+
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; p < end; p++)
+        if (*p == f->bytes[0] || *p == f->bytes[1] || *p == f->bytes[2])
+            return p;
+
+    return end;
+}
+
+static const unsigned char *scan_class(const FirstBytes *f, const unsigned char *p, const unsigned char *end) {
+#ifdef SCAN_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        p = scan_class_avx2(f, p, end);
+#endif
+
+    while (p < end && !cclass_has(&f->set, *p))
+        p++;
+
+    return p;
+}
+
+#ifdef SCAN_HAVE_AVX2
+/**
+ * Looks up every byte of a 32 byte block in the set at once
+ * The low nibble picks an entry out of lo_clear/lo_set with a shuffle, which gives the
+ * high nibbles that go with it. The shuffle gives 0 for any byte with the top bit set
+ * so flipping the top bit picks which of the two tables a byte uses
+ * Stops at the first block with a match (or when there's less than a block left)
+ */
+__attribute__((target("avx2")))
+static const unsigned char *scan_class_avx2(const FirstBytes *f, const unsigned char *p, const unsigned char *end) {
+    __m256i lo_clear = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) f->lo_clear));
+    __m256i lo_set   = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) f->lo_set));
+    __m256i bit      = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i low3     = _mm256_set1_epi8(7);
+    __m256i top      = _mm256_set1_epi8(-128);
+    __m256i zero     = _mm256_setzero_si256();
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i t = _mm256_or_si256(_mm256_shuffle_epi8(lo_clear, v),
+                _mm256_shuffle_epi8(lo_set, _mm256_xor_si256(v, top)));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low3);
+        __m256i m = _mm256_and_si256(t, _mm256_shuffle_epi8(bit, hi));
+
+        unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(m, zero));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return p;
+}
+#endif
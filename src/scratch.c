@@ -0,0 +1,140 @@
+/**
+ * Scratch space - what the engines write to while they're matching, kept per thread.
+ *
+ * A compiled Regex never changes once regex_compile is done with it, so any number of threads
+ * can match with the same one at once. The stuff that does change (the pike VM's thread lists,
+ * the backtrack stack, the DFA's state cache) lives in a Scratch, and every thread keeps its own
+ * for the last SCRATCH_SLOTS patterns it used. Nothing is shared so nothing needs a lock.
+ *
+ * They're found by the Regex's serial number instead of its address, so a new Regex that lands
+ * where a freed one used to be doesn't pick up the old one's leftovers. regex_free only gets
+ * rid of the calling thread's copy, the other threads' copies get pushed out when they need
+ * the room or freed when the thread exits
+ */
+
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Datatypes *****/
+typedef struct ThreadScratch_ {
+    struct Scratch_ *slots[SCRATCH_SLOTS]; // Most recently used first
+    int n;
+} ThreadScratch;
+
+
+
+/***** Constants *****/
+static _Thread_local ThreadScratch *thread_slots;
+
+// Only there so the thread's scratch gets freed when it exits
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static unsigned long last_serial;
+
+
+
+/***** Function Prototypes *****/
+Scratch *regex_scratch(const Regex *re);
+void scratch_release(const Regex *re);
+unsigned long scratch_serial(void);
+
+static ThreadScratch *thread_scratch(int create);
+static void create_scratch_key(void);
+static void free_thread_scratch(void *arg);
+static void free_scratch(Scratch *sc);
+
+
+
+// Returns this thread's scratch space for re, making it if there isn't any yet
+Scratch *regex_scratch(const Regex *re) {
+    ThreadScratch *ts = thread_scratch(1);
+    Scratch *sc;
+
+    // Most of the time it's the same pattern as last time
+    if (ts->n > 0 && ts->slots[0]->serial == re->serial)
+        return ts->slots[0];
+
+    for (int i = 1; i < ts->n; i++) {
+        if (ts->slots[i]->serial != re->serial)
+            continue;
+
+        // Moving it to the front so the ones that haven't been used in a while get pushed out first
+        sc = ts->slots[i];
+        memmove(&ts->slots[1], &ts->slots[0], sizeof(Scratch *) * i);
+        ts->slots[0] = sc;
+        return sc;
+    }
+
+    if (ts->n == SCRATCH_SLOTS)
+        free_scratch(ts->slots[--ts->n]);
+
+    sc = calloc(1, sizeof(Scratch));
+    sc->serial = re->serial;
+
+    memmove(&ts->slots[1], &ts->slots[0], sizeof(Scratch *) * ts->n);
+    ts->slots[0] = sc;
+    ts->n++;
+
+    return sc;
+}
+
+// Frees this thread's scratch space for re if it has any
+void scratch_release(const Regex *re) {
+    ThreadScratch *ts = thread_scratch(0);
+    if (ts == NULL)
+        return;
+
+    for (int i = 0; i < ts->n; i++) {
+        if (ts->slots[i]->serial != re->serial)
+            continue;
+
+        free_scratch(ts->slots[i]);
+        memmove(&ts->slots[i], &ts->slots[i + 1], sizeof(Scratch *) * (ts->n - i - 1));
+        ts->n--;
+        return;
+    }
+}
+
+// A number no other Regex has had
+unsigned long scratch_serial(void) {
+    return __atomic_add_fetch(&last_serial, 1, __ATOMIC_RELAXED);
+}
+
+static ThreadScratch *thread_scratch(int create) {
+    if (thread_slots == NULL && create) {
+        pthread_once(&scratch_once, create_scratch_key);
+        thread_slots = calloc(1, sizeof(ThreadScratch));
+        pthread_setspecific(scratch_key, thread_slots);
+    }
+
+    return thread_slots;
+}
+
+static void create_scratch_key(void) {
+    pthread_key_create(&scratch_key, free_thread_scratch);
+}
+
+// Called when a thread exits
+static void free_thread_scratch(void *arg) {
+    ThreadScratch *ts = arg;
+
+    for (int i = 0; i < ts->n; i++)
+        free_scratch(ts->slots[i]);
+    free(ts);
+    thread_slots = NULL;
+}
+
+static void free_scratch(Scratch *sc) {
+    pike_free(sc->pike);
+    backtracker_free(sc->backtracker);
+    dfa_destroy(sc->dfa);
+    free(sc);
+}
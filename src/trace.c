@@ -0,0 +1,143 @@
+/**
+ * Tracing - a record of every step the engines take, cheap enough for inputs far too big for regex_log.
+ *
+ * Instead of printing, each step goes in a ring buffer as an 8 byte event (what happened, which
+ * state, where in the input). The buffer is a fixed size so it only ever holds the last stretch
+ * of the run, which is normally the part that's interesting. regex_trace_print turns it into text
+ * afterwards, using the compiled pattern to say what each state is.
+ *
+ * Like regex_log it only exists in builds with REGEX_DEBUG. Without it the calls in the engines
+ * compile to nothing and regex_trace_start just says no
+ */
+
+
+
+#include <stdio.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Constants *****/
+#ifdef REGEX_DEBUG
+_Thread_local RegexTrace *match_trace;
+#endif
+
+
+
+/***** Function Prototypes *****/
+int regex_trace_start(RegexTrace *trace, RegexTraceEvent *events, size_t size);
+void regex_trace_stop(void);
+void regex_trace_print(const RegexTrace *trace, Regex *re, FILE *f);
+
+static void print_state(const State *s, FILE *f);
+
+
+
+int regex_trace_start(RegexTrace *trace, RegexTraceEvent *events, size_t size) {
+#ifdef REGEX_DEBUG
+    // A power of two so finding the next slot is a mask instead of a divide
+    size_t ring = 1;
+    while (ring * 2 <= size)
+        ring *= 2;
+
+    trace->events = events;
+    trace->size = (size == 0) ? 0 : ring;
+    trace->n = 0;
+    match_trace = (size == 0) ? NULL : trace;
+    return 1;
+#else
+    trace->events = events;
+    trace->size = 0;
+    trace->n = 0;
+    (void) size;
+    return 0;
+#endif
+}
+
+void regex_trace_stop(void) {
+#ifdef REGEX_DEBUG
+    match_trace = NULL;
+#endif
+}
+
+void regex_trace_print(const RegexTrace *trace, Regex *re, FILE *f) {
+    unsigned long long first = (trace->n > trace->size) ? trace->n - trace->size : 0;
+
+    if (first > 0)
+        fprintf(f, "(%llu earlier events were overwritten)\n", first);
+
+    for (unsigned long long i = first; i < trace->n; i++) {
+        const RegexTraceEvent *e = &trace->events[i & (trace->size - 1)];
+        const State *s = (e->state < (unsigned int) re->n_states) ? re->states[e->state] : NULL;
+
+        fprintf(f, "%10llu  %10u  ", i, e->pos);
+
+        switch (e->kind) {
+            case REGEX_TRACE_START:
+                fprintf(f, "start\n");
+                break;
+            case REGEX_TRACE_STEP:
+                fprintf(f, "step       ");
+                print_state(s, f);
+                break;
+            case REGEX_TRACE_PUSH:
+                fprintf(f, "push       ");
+                print_state(s, f);
+                break;
+            case REGEX_TRACE_POP:
+                fprintf(f, "pop        ");
+                print_state(s, f);
+                break;
+            case REGEX_TRACE_MEMO:
+                fprintf(f, "tried      ");
+                print_state(s, f);
+                break;
+            case REGEX_TRACE_MATCH:
+                fprintf(f, "match\n");
+                break;
+            case REGEX_TRACE_SKIP:
+                fprintf(f, "skip       from %u\n", e->state);
+                break;
+            case REGEX_TRACE_DFA_MISS:
+                fprintf(f, "dfa miss   %u states cached\n", e->state);
+                break;
+            case REGEX_TRACE_DFA_FLUSH:
+                fprintf(f, "dfa flush\n");
+                break;
+            default:
+                fprintf(f, "unknown event %u\n", e->kind);
+        }
+    }
+}
+
+// One line saying what a state is
+static void print_state(const State *s, FILE *f) {
+    if (s == NULL) {
+        fprintf(f, "(not a state in this pattern)\n");
+        return;
+    }
+
+    fprintf(f, "%4d %s", s->id, state_type_to_string(s->type));
+
+    switch (s->type) {
+        case S_LITERAL_CH:
+            fprintf(f, (s->data.ch >= 0x20 && s->data.ch < 0x7F) ? " '%c'" : " 0x%02X", s->data.ch);
+            break;
+        case S_LITERAL_STR:
+            fprintf(f, " \"%.*s\"", s->data.lit.len, (const char *) s->data.lit.str);
+            break;
+        case S_CG_NODE:
+        case S_BACK_REFERENCE:
+            fprintf(f, " %d", s->data.cg);
+            break;
+        case S_AQ_NODE:
+            fprintf(f, " {%u,%u}", s->data.aq.min, s->data.aq.max);
+            break;
+        default:
+            break;
+    }
+
+    fprintf(f, "\n");
+}
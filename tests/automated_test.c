@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,10 +13,35 @@ static int test_num = 1;
 static char default_fp[] = "./bin/resources/automated.txt";
 static LARGE_INTEGER freq;
 static LARGE_INTEGER total;
+static long long stream_match[2]; // The first match a stream finds
+
+
+// Every match a stream reports, with its groups
+typedef struct StreamMatches_ {
+    long long caps[4][6];
+    int n;
+} StreamMatches;
 
 
 /***** Function Prototypes *****/
 int run_test(char *pattern, char *string, char *match);
+int run_set_test(void);
+int run_parallel_test(void);
+int run_batch_test(void);
+int run_thread_test(void);
+int run_iter_test(void);
+int run_find_test(void);
+int run_group_test(void);
+int run_stream_test(void);
+int run_memo_test(void);
+int run_empty_loop_test(void);
+int run_stats_test(void);
+int run_trace_test(void);
+int run_cache_test(void);
+int run_optimize_test(void);
+void *thread_test(void *arg);
+void stream_callback(const long long *caps, int n_groups, void *data);
+void stream_collect(const long long *caps, int n_groups, void *data);
 int parse_line(FILE *f, char *p, char *s, char *m);
 char *collect_string_in_quotes(char *c, char *strp);
 int count_quotations(char *s);
@@ -71,6 +97,21 @@ int main(int argc, char *argv[]) {
             continue;
     } while (i != 0);
 
+    assert(run_set_test());
+    assert(run_parallel_test());
+    assert(run_batch_test());
+    assert(run_thread_test());
+    assert(run_iter_test());
+    assert(run_find_test());
+    assert(run_group_test());
+    assert(run_stream_test());
+    assert(run_memo_test());
+    assert(run_empty_loop_test());
+    assert(run_stats_test());
+    assert(run_trace_test());
+    assert(run_cache_test());
+    assert(run_optimize_test());
+
     // If we get here then everything is complete
 
     // Elapsed in milliseconds
@@ -102,14 +143,693 @@ int run_test(char *pattern, char *string, char *match) {
     printf("%s -> %s\n", pattern, str);
     printf("Test completed in %li microseconds\n\n", (long) elapsedt.QuadPart);
 
-    if (!strcmp(str, match)) {
-        free(str);
+    // The backtracker should give the same answer as whichever engine regex() picked
+    char *bt_str = regex(pattern, string, REGEX_SUPPRESS_LOGGING | REGEX_BACKTRACK);
+    int rtn = !strcmp(str, match) && !strcmp(bt_str, match);
+
+    // regex_match should agree on whether there was a match at all
+    Regex *re = regex_compile(pattern, REGEX_SUPPRESS_LOGGING);
+    if (re != NULL) {
+        rtn = rtn && regex_match(re, string) == (*match != '\0');
+
+        // Feeding it in one character at a time should find the same thing
+        RegexStream *st = regex_stream_open(re, stream_callback, NULL);
+        if (st != NULL) {
+            stream_match[0] = -1;
+            stream_match[1] = -1;
+            for (char *c = string; *c != '\0'; c++)
+                regex_stream_feed(st, c, 1);
+            regex_stream_end(st);
+            regex_stream_free(st);
+
+            int n = (int) (stream_match[1] - stream_match[0]);
+            rtn = rtn && (int) strlen(match) == n && (n == 0 || !strncmp(string + stream_match[0], match, n));
+        }
+
+        regex_free(re);
+    }
+
+    free(str);
+    free(bt_str);
+    return rtn;
+
+}
+
+void stream_callback(const long long *caps, int n_groups, void *data) {
+    (void) n_groups;
+    (void) data;
+
+    if (stream_match[0] == -1) {
+        stream_match[0] = caps[0];
+        stream_match[1] = caps[1];
+    }
+}
+
+// Checks a RegexSet gives the same answers as matching each pattern on its own
+int run_set_test(void) {
+    char *patterns[] = {"abc", "^abc", "b*", "(a+)b\\1", "[0-9]+x", "a|bc", "c[^a]t", "x{2}"};
+    char *strings[] = {"abc", "xabc", "aabaa", "12x cot", "b", "xx", ""};
+    int n = sizeof(patterns) / sizeof(patterns[0]);
+    int ids[sizeof(patterns) / sizeof(patterns[0])];
+    int rtn = 1;
+
+    printf("----- Regex set -----\n");
+    RegexSet *set = regex_set_compile(patterns, n, REGEX_SUPPRESS_LOGGING);
+    if (set == NULL)
+        return 0;
+
+    for (int i = 0; i < (int) (sizeof(strings) / sizeof(strings[0])); i++) {
+        int n_matched = regex_set_match(set, strings[i], ids);
+        int k = 0;
+
+        for (int j = 0; j < n; j++) {
+            Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING);
+            if (regex_match(re, strings[i]))
+                rtn = rtn && k < n_matched && ids[k++] == j;
+            regex_free(re);
+        }
+
+        rtn = rtn && k == n_matched;
+        printf("\"%s\" matched %d patterns\n", strings[i], n_matched);
+    }
+
+    regex_set_free(set);
+    return rtn;
+}
+
+/**
+ * Checks regex_match_parallel against regex_match on a buffer big enough to get split up,
+ * with the matches planted across the places it gets cut
+ */
+int run_parallel_test(void) {
+    char *patterns[] = {"needle", "^xx", "a[^z]*z", "(ab|cd)+e", "q.*k", "x+y", "[0-9]{2}"};
+    int sizes[] = {1 << 20, (1 << 20) + 7};
+    int threads[] = {1, 3, 4};
+    int rtn = 1;
+
+    printf("----- Parallel -----\n");
+    for (int i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+        int len = sizes[i];
+        char *buf = malloc(len + 1);
+
+        for (int plant = 0; plant < 4; plant++) {
+            // x everywhere with something sitting across a quarter of the way through
+            memset(buf, 'x', len);
+            buf[len] = '\0';
+            int at = plant * (len / 4) - 3;
+            if (plant == 1)
+                memcpy(buf + at, "needle", 6);
+            else if (plant == 2)
+                memcpy(buf + at, "abcdabe", 7);
+            else if (plant == 3) {
+                buf[at] = 'a';
+                buf[len - 1] = 'z';
+            }
+
+            for (int j = 0; j < (int) (sizeof(patterns) / sizeof(patterns[0])); j++) {
+                Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING);
+                int want = regex_match(re, buf);
+
+                for (int k = 0; k < (int) (sizeof(threads) / sizeof(threads[0])); k++)
+                    rtn = rtn && regex_match_parallel(re, buf, len, threads[k]) == want;
+
+                regex_free(re);
+            }
+        }
+
+        free(buf);
+    }
+
+    printf("Parallel matches agree\n");
+    return rtn;
+}
+
+/**
+ * Checks regex_match_batch and regex_match_len against regex_match on pieces of a string that aren't NUL terminated,
+ * on one thread and a few, and with a DFA cache small enough to keep filling up
+ */
+int run_batch_test(void) {
+    char *patterns[] = {"abc", "^ab", "b+c?d", "(a|bc)+d", "[0-9]x", "(ab)\\1", "c{2}"};
+    char text[] = "abcd bcbcd 1x abab ccd aabcccbd 9 abc";
+    RegexInput inputs[600];
+    int results[600];
+    int rtn = 1;
+
+    printf("----- Batch -----\n");
+    for (int i = 0; i < 600; i++) {
+        inputs[i].string = text + i % (sizeof(text) - 1);
+        inputs[i].len = (i * 7) % (sizeof(text) - i % (sizeof(text) - 1));
+    }
+
+    for (int j = 0; j < (int) (sizeof(patterns) / sizeof(patterns[0])); j++) {
+        for (int small = 0; small < 2; small++) {
+            Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING);
+            if (small)
+                regex_set_dfa_memory(re, 0);
+
+            for (int threads = 1; threads <= 3; threads += 2) {
+                regex_match_batch(re, inputs, 600, results, threads);
+
+                for (int i = 0; i < 600; i++) {
+                    char str[sizeof(text)];
+                    memcpy(str, inputs[i].string, inputs[i].len);
+                    str[inputs[i].len] = '\0';
+                    rtn = rtn && results[i] == regex_match(re, str);
+                    rtn = rtn && regex_match_len(re, inputs[i].string, inputs[i].len) == results[i];
+                }
+            }
+
+            regex_free(re);
+        }
+    }
+
+    printf("Batch matches agree\n");
+    return rtn;
+}
+
+// Every match regex_iter_next finds has to be the same one regex_exec finds on what's left of the string
+int run_iter_test(void) {
+    char *patterns[] = {"[0-9]+", "a*", "(a|b)(c)?", "(x+)y\\1", "^ab", "b{1,2}", "q"};
+    char *strings[] = {"12 345 6x78", "baaab aa", "abcbacab", "xxyxx xyx xxyx", "abab", "bbbbb", "abc"};
+    int counts[] = {4, 2, 6, 3, 1, 3, 0};
+    long long caps[6];
+    int rtn = 1;
+
+    printf("----- Iterator -----\n");
+    for (int j = 0; j < (int) (sizeof(patterns) / sizeof(patterns[0])); j++) {
+        Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING);
+        int len = (int) strlen(strings[j]);
+        int n = 0;
+        long long end = 0;
+        RegexIter it;
+
+        regex_iter_init(&it, re, strings[j], len);
+        while (regex_iter_next(&it, caps)) {
+            // The first place what regex_exec finds after the last match turns up is where the match starts
+            char *expected = regex_exec(re, strings[j] + end);
+            char *at = strstr(strings[j] + end, expected);
+            int len_match = (int) (caps[1] - caps[0]);
+
+            rtn = rtn && len_match > 0 && (int) strlen(expected) == len_match && at == strings[j] + caps[0];
+            for (int g = 1; g <= regex_group_count(re); g++)
+                rtn = rtn && (caps[2 * g] == -1 || (caps[0] <= caps[2 * g] && caps[2 * g + 1] <= caps[1]));
+
+            free(expected);
+            end = caps[1];
+            n++;
+        }
+
+        rtn = rtn && n == counts[j] && !regex_iter_next(&it, caps);
+        regex_free(re);
+    }
+
+    // Every match gets its own groups, one that's in the alternative not taken is -1 at both ends
+    char *alt_patterns[] = {"(a(b)|c)", "(x)y|z"};
+    char *alt_strings[] = {"abcab", "zxyz"};
+    long long alt_caps[][3][6] = {
+        {{0, 2, 0, 2, 1, 2}, {2, 3, 2, 3, -1, -1}, {3, 5, 3, 5, 4, 5}},
+        {{0, 1, -1, -1}, {1, 3, 1, 2}, {3, 4, -1, -1}},
+    };
+
+    for (int j = 0; j < 2; j++) {
+        Regex *re = regex_compile(alt_patterns[j], REGEX_SUPPRESS_LOGGING);
+        RegexIter it;
+        int n = 0;
+
+        regex_iter_init(&it, re, alt_strings[j], strlen(alt_strings[j]));
+        while (n < 3 && regex_iter_next(&it, caps)) {
+            for (int i = 0; i < 2 * (regex_group_count(re) + 1); i++)
+                rtn = rtn && caps[i] == alt_caps[j][n][i];
+            n++;
+        }
+
+        rtn = rtn && n == 3 && !regex_iter_next(&it, caps);
+        regex_free(re);
+    }
+
+    printf("Iterator matches agree\n");
+    return rtn;
+}
+
+// regex_find on input that has '\0's in it and doesn't end with one
+int run_find_test(void) {
+    char *patterns[] = {"b.c", "(a+)(x)?b\\1", "[0-9]+", "^\\w+"};
+    char input[] = {'z', 'b', '\0', 'c', 'a', 'a', 'b', 'a', 'a', '1', '2', '3', 'x'};
+    size_t lens[] = {sizeof(input), sizeof(input), 11, sizeof(input)};
+    long long expected[][6] = {{1, 4}, {4, 9, 4, 6, -1, -1}, {9, 11}, {0, 2}};
+    long long caps[6];
+    int rtn = 1;
+
+    printf("----- Find -----\n");
+    for (int j = 0; j < (int) (sizeof(patterns) / sizeof(patterns[0])); j++) {
+        for (int backtrack = 0; backtrack < 2; backtrack++) {
+            Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING | (backtrack ? REGEX_BACKTRACK : 0));
+
+            rtn = rtn && regex_find(re, input, lens[j], caps);
+            for (int i = 0; i < 2 * (regex_group_count(re) + 1); i++)
+                rtn = rtn && caps[i] == expected[j][i];
+
+            // Nothing past len gets looked at, even though there's more in the buffer
+            if (regex_find(re, input, expected[j][1] - 1, caps))
+                rtn = rtn && caps[1] <= expected[j][1] - 1;
+            regex_free(re);
+        }
+    }
+
+    printf("Finds agree\n");
+    return rtn;
+}
+
+// Groups in an alternative that didn't get taken are -1 at both ends, on both engines
+int run_group_test(void) {
+    char *patterns[] = {"(a(b)|c)", "(a(b)|c)", "(x)y|z", "(a|(b)|(c))d", "((a)|(b))+"};
+    char *strings[] = {"c", "ab", "z", "cd", "ab"};
+    long long expected[][8] = {
+        {0, 1, 0, 1, -1, -1},
+        {0, 2, 0, 2, 1, 2},
+        {0, 1, -1, -1},
+        {0, 2, 0, 1, -1, -1, 0, 1},
+        {0, 2, 0, 1, 0, 1, 1, 2},
+    };
+    long long caps[8];
+    int rtn = 1;
+
+    printf("----- Groups -----\n");
+    for (int j = 0; j < (int) (sizeof(patterns) / sizeof(patterns[0])); j++) {
+        for (int backtrack = 0; backtrack < 2; backtrack++) {
+            Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING | (backtrack ? REGEX_BACKTRACK : 0));
+
+            rtn = rtn && regex_find(re, strings[j], strlen(strings[j]), caps);
+            for (int i = 0; i < 2 * (regex_group_count(re) + 1); i++)
+                rtn = rtn && caps[i] == expected[j][i];
+            regex_free(re);
+        }
+    }
+
+    // As many groups as there's room for, and one more which doesn't compile
+    char many[4 * (REGEX_MAX_GROUPS + 1) + 1];
+    long long many_caps[2 * (REGEX_MAX_GROUPS + 1)];
+    for (int i = 0; i < REGEX_MAX_GROUPS + 1; i++)
+        memcpy(many + 4 * i, "(a)?", 4);
+    many[4 * (REGEX_MAX_GROUPS + 1)] = '\0';
+
+    Regex *re = regex_compile(many + 4, REGEX_SUPPRESS_LOGGING);
+    rtn = rtn && re != NULL && regex_group_count(re) == REGEX_MAX_GROUPS;
+    rtn = rtn && regex_find(re, "aa", 2, many_caps) && many_caps[3] == 1 && many_caps[4] == 1
+              && many_caps[2 * REGEX_MAX_GROUPS] == -1;
+    regex_free(re);
+
+    char *set_patterns[] = {"b", many};
+    rtn = rtn && regex_compile(many, REGEX_SUPPRESS_LOGGING) == NULL;
+    rtn = rtn && regex_set_compile(set_patterns, 2, REGEX_SUPPRESS_LOGGING) == NULL;
+
+    printf("Groups agree\n");
+    return rtn;
+}
+
+void stream_collect(const long long *caps, int n_groups, void *data) {
+    StreamMatches *m = data;
+    if (m->n < 4)
+        memcpy(m->caps[m->n], caps, sizeof(long long) * 2 * (n_groups + 1));
+    m->n++;
+}
+
+// A stream fed a byte at a time reports the same groups regex_iter_next finds
+int run_stream_test(void) {
+    char *patterns[] = {"(a(b)|c)", "(x)y|z"};
+    char *strings[] = {"abcab", "zxyz"};
+    long long expected[][3][6] = {
+        {{0, 2, 0, 2, 1, 2}, {2, 3, 2, 3, -1, -1}, {3, 5, 3, 5, 4, 5}},
+        {{0, 1, -1, -1}, {1, 3, 1, 2}, {3, 4, -1, -1}},
+    };
+    int rtn = 1;
+
+    printf("----- Stream -----\n");
+    for (int j = 0; j < 2; j++) {
+        Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING);
+        StreamMatches m = {.n = 0};
+        RegexStream *st = regex_stream_open(re, stream_collect, &m);
+
+        for (char *c = strings[j]; *c != '\0'; c++)
+            regex_stream_feed(st, c, 1);
+        regex_stream_end(st);
+
+        rtn = rtn && m.n == 3;
+        for (int k = 0; k < 3 && k < m.n; k++)
+            for (int i = 0; i < 2 * (regex_group_count(re) + 1); i++)
+                rtn = rtn && m.caps[k][i] == expected[j][k][i];
+
+        regex_stream_free(st);
+        regex_free(re);
+    }
+
+    // A match that's been going for a long time doesn't need any of its input kept
+    Regex *re = regex_compile("ax*b", REGEX_SUPPRESS_LOGGING);
+    StreamMatches m = {.n = 0};
+    RegexStream *st = regex_stream_open(re, stream_collect, &m);
+    char chunk[4096];
+
+    memset(chunk, 'x', sizeof(chunk));
+    regex_stream_feed(st, "a", 1);
+    for (int i = 0; i < 256; i++)
+        regex_stream_feed(st, chunk, sizeof(chunk));
+    rtn = rtn && m.n == 0 && regex_stream_buffered(st) < sizeof(chunk);
+
+    // and it still gets reported from where it started
+    regex_stream_feed(st, "b", 1);
+    regex_stream_end(st);
+    rtn = rtn && m.n == 1 && m.caps[0][0] == 0 && m.caps[0][1] == 2 + 256 * (long long) sizeof(chunk);
+
+    regex_stream_free(st);
+    regex_free(re);
+
+    printf("Streams agree\n");
+    return rtn;
+}
+
+// Patterns that take the plain backtracker exponential time, these would never finish without the memo
+int run_memo_test(void) {
+    char *patterns[] = {"(a|aa)+c", "(a*)*b", "(a|a)+b", "((a+)+)y"};
+    char string[64];
+    long long caps[6];
+    int rtn = 1;
+
+    printf("----- Memo -----\n");
+    memset(string, 'a', 50);
+    for (int j = 0; j < (int) (sizeof(patterns) / sizeof(patterns[0])); j++) {
+        Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING | REGEX_BACKTRACK);
+        Regex *pike = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING);
+        long long pike_caps[6];
+
+        rtn = rtn && !regex_find(re, string, 50, caps);
+
+        // Same captures as the pike VM once there is something to find
+        string[50] = patterns[j][strlen(patterns[j]) - 1];
+        rtn = rtn && regex_find(re, string, 51, caps) && regex_find(pike, string, 51, pike_caps);
+        rtn = rtn && !memcmp(caps, pike_caps, sizeof(long long) * 2 * (regex_group_count(re) + 1));
+
+        // Too much input for the memo, these go to the pike VM instead of taking for ever
+        char *big = malloc(200001);
+        memset(big, 'a', 200000);
+        rtn = rtn && !regex_find(re, big, 200000, caps);
+        big[200000] = string[50];
+        rtn = rtn && regex_find(re, big, 200001, caps) && caps[0] == 0 && caps[1] == 200001;
+        free(big);
+
+        regex_free(re);
+        regex_free(pike);
+    }
+
+    printf("Memoized backtracking finished\n");
+    return rtn;
+}
+
+/**
+ * A loop round something that can match nothing stops going round at the same place on the pike VM,
+ * the memoized backtracker and the plain one. An empty group referenced at the end can't match
+ * anything different but it stops the memo being used, which leaves the plain backtracker
+ */
+int run_empty_loop_test(void) {
+    char *patterns[] = {"(.*?)*", "(a*?)*", "(a*?b?)+", "((x?\?|(.*?|(x*))))*", "(a|b*)*?c",
+                        "((a*)*|b)+", "(a?)+?b", "(((.*?|b)*).*(c?\?)?\?){2,}", "c*?(c?|b?)*[ab]*"};
+    char *strings[] = {"xaab", "xaab", "abababab", "xx11cc1", "abbc", "aabab", "aab", "ba1xxac", "cbcax1a"};
+    long long caps[3][16];
+    char plain[64];
+    int rtn = 1;
+
+    printf("----- Empty loops -----\n");
+    for (int j = 0; j < (int) (sizeof(patterns) / sizeof(patterns[0])); j++) {
+        Regex *re = regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING);
+        int n = regex_group_count(re);
+        snprintf(plain, sizeof(plain), "%s()\\%d", patterns[j], n + 1);
+
+        Regex *res[3] = {re, regex_compile(patterns[j], REGEX_SUPPRESS_LOGGING | REGEX_BACKTRACK),
+                         regex_compile(plain, REGEX_SUPPRESS_LOGGING)};
+        for (int e = 0; e < 3; e++)
+            rtn = rtn && regex_find(res[e], strings[j], strlen(strings[j]), caps[e]);
+        rtn = rtn && !memcmp(caps[0], caps[1], sizeof(long long) * 2 * (n + 1));
+        rtn = rtn && !memcmp(caps[0], caps[2], sizeof(long long) * 2 * (n + 1));
+
+        for (int e = 0; e < 3; e++)
+            regex_free(res[e]);
+    }
+
+    printf("Every engine left the loops at the same place\n");
+    return rtn;
+}
+
+int run_stats_test(void) {
+    RegexStats st;
+    long long caps[4];
+    char string[1100];
+    int rtn = 1;
+
+    printf("----- Stats -----\n");
+
+    // Everything skipped until the literal turns up
+    Regex *re = regex_compile("xyz", REGEX_SUPPRESS_LOGGING);
+    memset(string, 'a', 1000);
+    strcpy(string + 1000, "xyz");
+
+    regex_stats_start(&st);
+    rtn = rtn && regex_find(re, string, 1003, caps);
+    regex_stats_stop();
+    rtn = rtn && st.calls == 1 && st.bytes == 1003 && st.prefilter_skips == 1000 && st.starts > 0;
+    rtn = rtn && st.states > 0 && st.memory > 0 && st.pushes == 0;
+
+    // Nothing gets counted once it's stopped
+    regex_find(re, string, 1003, caps);
+    rtn = rtn && st.calls == 1;
+
+    // The second time through every transition is already cached
+    regex_stats_start(&st);
+    rtn = rtn && regex_match(re, string);
+    rtn = rtn && st.dfa_misses > 0 && st.dfa_memory > 0;
+    regex_stats_start(&st);
+    rtn = rtn && regex_match(re, string);
+    regex_stats_stop();
+    rtn = rtn && st.dfa_misses == 0 && st.dfa_hits == 3 && st.states == 3;
+    regex_free(re);
+
+    // The 'x' can't start a match so it's the only offset that doesn't get tried
+    re = regex_compile("(a|b)*c", REGEX_SUPPRESS_LOGGING | REGEX_BACKTRACK);
+    regex_stats_start(&st);
+    rtn = rtn && regex_find(re, "ababababx", 9, caps) == 0;
+    regex_stats_stop();
+    rtn = rtn && st.starts == 8 && st.prefilter_skips == 1 && st.pushes > 0 && st.pops > 0 && st.peak_depth > 0 && st.peak_depth <= st.pushes;
+    regex_free(re);
+
+    // A cache with no room has to keep throwing it away
+    re = regex_compile("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)c", REGEX_SUPPRESS_LOGGING);
+    regex_set_dfa_memory(re, 1);
+    for (int i = 0; i < 1000; i++)
+        string[i] = "ab"[(i * 7 + i / 3) % 2];
+    string[1000] = '\0';
+
+    regex_stats_start(&st);
+    rtn = rtn && !regex_match(re, string);
+    regex_stats_stop();
+    rtn = rtn && st.dfa_flushes > 0;
+    regex_free(re);
+
+    // The other threads' numbers get added in when they're done
+    size_t len = 1 << 20;
+    char *big = malloc(len);
+    memset(big, 'a', len);
+    re = regex_compile("b", REGEX_SUPPRESS_LOGGING);
+
+    regex_stats_start(&st);
+    rtn = rtn && !regex_match_parallel(re, big, len, 4);
+    regex_stats_stop();
+    rtn = rtn && st.calls == 1 && st.bytes == len && st.prefilter_skips == len;
+
+    regex_free(re);
+    free(big);
+
+    printf("Stats finished\n");
+    return rtn;
+}
+
+int run_trace_test(void) {
+    RegexTraceEvent events[128];
+    RegexTrace trace;
+    long long caps[4];
+    int rtn = 1;
+
+    printf("----- Trace -----\n");
+    Regex *re = regex_compile("(a|b)*c", REGEX_SUPPRESS_LOGGING | REGEX_BACKTRACK);
+
+    // Nothing to test if the library was built without it
+    if (!regex_trace_start(&trace, events, 100)) {
+        regex_free(re);
+        printf("Tracing isn't built in\n");
         return 1;
-    } else {
+    }
+
+    rtn = rtn && trace.size == 64;
+    rtn = rtn && regex_find(re, "abc", 3, caps);
+    regex_trace_stop();
+
+    int starts = 0, pushes = 0, pops = 0, matches = 0;
+    for (unsigned long long i = 0; i < trace.n; i++) {
+        starts += events[i].kind == REGEX_TRACE_START;
+        pushes += events[i].kind == REGEX_TRACE_PUSH;
+        pops += events[i].kind == REGEX_TRACE_POP;
+        if (events[i].kind == REGEX_TRACE_MATCH)
+            matches++, rtn = rtn && events[i].pos == 3;
+    }
+    rtn = rtn && trace.n < 64 && starts == 1 && pushes > 0 && pops > 0 && matches == 1;
+
+    // Nothing more goes in once it's stopped
+    unsigned long long n = trace.n;
+    regex_find(re, "abc", 3, caps);
+    rtn = rtn && trace.n == n;
+
+    // Only the last 32 are kept once it wraps round, and they can still be printed
+    char string[200];
+    memset(string, 'a', 199);
+    string[199] = '\0';
+    regex_trace_start(&trace, events, 32);
+    rtn = rtn && !regex_find(re, string, 199, caps);
+    regex_trace_stop();
+    rtn = rtn && trace.n > 32;
+
+    FILE *f = tmpfile();
+    regex_trace_print(&trace, re, f);
+    rtn = rtn && ftell(f) > 0;
+    fclose(f);
+
+    regex_free(re);
+
+    printf("Trace finished\n");
+    return rtn;
+}
+
+int run_cache_test(void) {
+    RegexCacheStats stats;
+    char pattern[32];
+    int rtn = 1;
+
+    printf("----- Cache -----\n");
+    regex_cache_clear();
+
+    // Only the first one compiles it
+    for (int i = 0; i < 10; i++) {
+        char *str = regex("a(b|c)+d", "xabcbdy", REGEX_SUPPRESS_LOGGING);
+        rtn = rtn && !strcmp(str, "abcbd");
         free(str);
-        return 0;
+    }
+    regex_cache_stats(&stats);
+    rtn = rtn && stats.misses == 1 && stats.hits == 9 && stats.entries == 1;
+
+    // Different options are a different compiled pattern
+    char *str = regex("a(b|c)+d", "xabcbdy", REGEX_SUPPRESS_LOGGING | REGEX_BACKTRACK);
+    rtn = rtn && !strcmp(str, "abcbd");
+    free(str);
+    regex_cache_stats(&stats);
+    rtn = rtn && stats.misses == 2 && stats.entries == 2;
+
+    // More patterns than it has room for push the old ones out
+    for (int i = 0; i < 512; i++) {
+        sprintf(pattern, "x%dy", i);
+        str = regex(pattern, "ax12y", REGEX_SUPPRESS_LOGGING);
+        rtn = rtn && !strcmp(str, (i == 12) ? "x12y" : "");
+        free(str);
+    }
+    regex_cache_stats(&stats);
+    rtn = rtn && stats.evictions > 0 && stats.entries <= 128; // 16 shards of 8
+
+    // One that keeps getting used never gets pushed out, however many others come through
+    regex_cache_clear();
+    for (int i = 0; i < 512; i++) {
+        sprintf(pattern, "y%dz", i);
+        free(regex(pattern, "", REGEX_SUPPRESS_LOGGING));
+        free(regex("a(b|c)+d", "", REGEX_SUPPRESS_LOGGING));
+    }
+    regex_cache_stats(&stats);
+    rtn = rtn && stats.misses == 513 && stats.hits == 511;
+
+    regex_cache_clear();
+    regex_cache_stats(&stats);
+    rtn = rtn && stats.entries == 0 && stats.hits == 0 && stats.misses == 0;
+
+    printf("Cache finished\n");
+    return rtn;
+}
+
+// A run of literals is one step for the backtracker, however long it is
+int run_optimize_test(void) {
+    RegexStats st;
+    long long caps[4];
+    int rtn = 1;
+
+    printf("----- Optimize -----\n");
+    Regex *re = regex_compile("(needle) in a haystack, \\1", REGEX_SUPPRESS_LOGGING);
+
+    regex_stats_start(&st);
+    rtn = rtn && regex_find(re, "a needle in a haystack, needle", 30, caps);
+    regex_stats_stop();
+    rtn = rtn && caps[0] == 2 && caps[1] == 30 && caps[2] == 2 && caps[3] == 8;
+
+    // Into the group, the literals, out of it, the rest of the literals, the back reference and the end
+    rtn = rtn && st.states == 6;
+
+    // Stopping short of the end of the input doesn't read past it
+    rtn = rtn && !regex_find(re, "a needle in a haystack, nee", 27, caps);
+    regex_free(re);
+
+    printf("Optimize finished\n");
+    return rtn;
+}
+
+// The patterns run_thread_test shares between its threads, and what each should find
+static char *thread_patterns[] = {"(a+)b\\1", "ba{2,4}", "(abc|def)+g", "x[0-9]+y", "^ab"};
+static char *thread_strings[] = {"xaaabaaa", "baaaa", "abcdefg", "zx123y", "abab"};
+static char *thread_matches[] = {"aaabaaa", "baaaa", "abcdefg", "x123y", "ab"};
+static Regex *thread_res[5];
+
+// Every thread matches with the same compiled patterns and compiles some of its own at the same time
+int run_thread_test(void) {
+    pthread_t threads[4];
+    int failed[4] = {0};
+    int rtn = 1;
+
+    printf("----- Threads -----\n");
+    for (int i = 0; i < 5; i++)
+        thread_res[i] = regex_compile(thread_patterns[i], REGEX_SUPPRESS_LOGGING);
+
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, thread_test, &failed[i]);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        rtn = rtn && !failed[i];
+    }
+
+    for (int i = 0; i < 5; i++)
+        regex_free(thread_res[i]);
+
+    printf("Threads agree\n");
+    return rtn;
+}
+
+void *thread_test(void *arg) {
+    int *failed = arg;
+
+    for (int n = 0; n < 200; n++) {
+        for (int i = 0; i < 5; i++) {
+            char *str = regex_exec(thread_res[i], thread_strings[i]);
+            char *own = regex(thread_patterns[i], thread_strings[i], REGEX_SUPPRESS_LOGGING);
+
+            if (strcmp(str, thread_matches[i]) || strcmp(own, thread_matches[i])
+                    || !regex_match(thread_res[i], thread_strings[i]))
+                *failed = 1;
+
+            free(str);
+            free(own);
+        }
     }
 
+    return NULL;
 }
 
 /**
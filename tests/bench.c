@@ -0,0 +1,555 @@
+/**
+ * bench - compile time, match latency and throughput for each engine, Linux only
+ *
+ * Every pattern gets run over a few generated corpora (log lines, CSV, C source) and the ReDoS
+ * ones over input made to blow backtrackers up. Each engine is timed on its own, and glibc's
+ * regcomp/regexec goes over the same lines so there's something local to compare against.
+ * Cycles, instructions and cache misses come from perf_event_open when the kernel lets us
+ * have them, otherwise those columns are left empty.
+ *
+ * Output is CSV on stdout with one row per measurement, so runs can be diffed to catch regressions
+ *
+ * usage: bench [-t ms] [-s bytes] [-f file]...
+ *
+ * The numbers are only as good as the library build, use make lib CFLAGS=-O2 for anything worth comparing
+ */
+
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <regex.h> // glibc's, bench gets built with -iquote src so this one isn't ours
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "regex.h"
+#include "regex_internal.h" // To know which engine regex_match picks for a pattern
+
+
+
+/***** Defines *****/
+#define BENCH_MIN_MS      200       // Every measurement runs at least this long
+#define BENCH_CORPUS_SIZE (4 << 20)
+#define BENCH_MAX_CORPORA 16
+#define BENCH_N_COUNTERS  3
+
+
+
+/***** Datatypes *****/
+typedef struct Corpus_ {
+    char *name;
+    char *data;
+    size_t size;
+    RegexInput *lines; // Without the newlines
+    int n_lines;
+    int redos; // Only gets the ReDoS patterns
+} Corpus;
+
+typedef struct BenchPattern_ {
+    char *pattern;
+    char *posix; // The same thing written for regcomp
+    int redos;
+} BenchPattern;
+
+// What one measurement runs on, each engine only uses the parts it needs
+typedef struct BenchRun_ {
+    Regex *re;
+    regex_t posix;
+    char *pattern;
+    char *posix_pattern;
+    struct Corpus_ *corpus;
+    RegexInput line; // The one the latency gets measured on, NUL terminated
+    int *results;
+} BenchRun;
+
+// Does one go of whatever is being measured, returns how many matches it found
+typedef long (*BenchFn)(BenchRun *run);
+
+typedef struct Result_ {
+    long long iterations;
+    double ns; // Per iteration
+    double counters[BENCH_N_COUNTERS]; // Per iteration, -1 if there weren't any
+    long matches;
+} Result;
+
+
+
+/***** Constants *****/
+static const BenchPattern patterns[] = {
+    {"error",                            "error",                                0},
+    {"[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+",  "[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+",     0},
+    {"\\d{4}-\\d{2}-\\d{2}",             "[0-9]{4}-[0-9]{2}-[0-9]{2}",           0},
+    {"(GET|POST) /[a-z/]+",              "(GET|POST) /[a-z/]+",                  0},
+    {"[a-z.]+@[a-z]+\\.com",             "[a-z.]+@[a-z]+\\.com",                 0},
+    {"[A-Za-z_]\\w*\\(",                 "[A-Za-z_][A-Za-z0-9_]*\\(",            0},
+    {".*sshd.*Accepted",                 ".*sshd.*Accepted",                     0},
+    {"([a-z])\\1",                       "([a-z])\\1",                           0},
+    {"\\w{30,400}",                      "[A-Za-z0-9_]{30,400}",                 0},
+
+    {"(a|aa)+b",                         "(a|aa)+b",                             1},
+    {"(a*)*b",                           "(a*)*b",                               1},
+    {"(x+x+)+y",                         "(x+x+)+y",                             1},
+    {"(\\d+)*x",                         "([0-9]+)*x",                           1},
+    {"\\d{1,1000}x",                     "[0-9]{1,1000}x",                       1},
+    {"\\d{1,5000}x",                     "[0-9]{1,5000}x",                       1}, // Too big to write out, see repeat_fragment
+};
+
+static const char *engine_names[] = {"dfa", "pike", "backtrack", "posix"};
+
+static const char *log_users[] = {"root", "alice", "bob", "deploy", "www-data", "postgres"};
+static const char *log_paths[] = {"/index.html", "/api/v1/users", "/static/app.js", "/login", "/api/v2/orders/items"};
+static const char *csv_names[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"};
+static const char *csv_cities[] = {"Paris", "Berlin", "Lisbon", "Oslo", "Madrid", "Vienna", "Dublin"};
+static const char *source_lines[] = {
+    "static int parse_line(FILE *f, char *buf, int size) {",
+    "    for (int i = 0; i < n_states; i++) {",
+    "        if (seen[s->id] == gen)",
+    "            continue;",
+    "    // Pushed backwards so next1 comes off the stack first",
+    "    return create_fragment(s, create_state_list(&s->next1));",
+    "    memcpy(l->dense[i].caps, pd->caps, sizeof(int) * pd->n_slots);",
+    "}",
+    "",
+    "#include \"regex_internal.h\"",
+    "    char *nl = memchr(p, '\\n', end - p);",
+    "        regex_log(\"State %p, Type = %s\\n\", (void *) s, state_type_to_string(s->type));",
+};
+
+static unsigned long long seed = 0x9E3779B97F4A7C15ull;
+static double min_ns = BENCH_MIN_MS * 1e6;
+static int counter_fds[BENCH_N_COUNTERS] = {-1, -1, -1};
+
+
+
+/***** Function Prototypes *****/
+static void usage(void);
+static unsigned int next_random(void);
+static Corpus *make_corpus(char *name, size_t size, int redos);
+static Corpus *load_corpus(char *path);
+static void split_lines(Corpus *c);
+static void free_corpus(Corpus *c);
+static void generate_line(char *name, char *buf, size_t size);
+
+static void open_counters(void);
+static Result measure(BenchFn fn, BenchRun *run);
+static void print_row(const char *corpus, const char *pattern, const char *engine, const char *test,
+        size_t bytes, Result *r, int with_matches);
+
+static long compile_ours(BenchRun *run);
+static long compile_posix(BenchRun *run);
+static long latency_dfa(BenchRun *run);
+static long latency_find(BenchRun *run);
+static long latency_posix(BenchRun *run);
+static long scan_dfa(BenchRun *run);
+static long scan_find(BenchRun *run);
+static long scan_posix(BenchRun *run);
+
+static void bench_pattern(Corpus **corpora, int n_corpora, const BenchPattern *p);
+
+
+
+int main(int argc, char *argv[]) {
+    Corpus *corpora[BENCH_MAX_CORPORA];
+    int n_corpora = 0;
+    size_t size = BENCH_CORPUS_SIZE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:f:")) != -1) {
+        switch (opt) {
+            case 't': min_ns = atof(optarg) * 1e6; break;
+            case 's': size = strtoul(optarg, NULL, 10); break;
+            case 'f':
+                if (n_corpora == BENCH_MAX_CORPORA - 4)
+                    usage();
+                if ((corpora[n_corpora] = load_corpus(optarg)) == NULL)
+                    return 1;
+                n_corpora++;
+                break;
+            default: usage();
+        }
+    }
+
+    corpora[n_corpora++] = make_corpus("log", size, 0);
+    corpora[n_corpora++] = make_corpus("csv", size, 0);
+    corpora[n_corpora++] = make_corpus("source", size, 0);
+    corpora[n_corpora++] = make_corpus("redos", size / 16, 1);
+
+    open_counters();
+    printf("corpus,pattern,engine,test,bytes,iterations,ns_per_op,mb_per_s,matches,cycles,instructions,cache_misses\n");
+
+    for (int i = 0; i < (int) (sizeof(patterns) / sizeof(patterns[0])); i++)
+        bench_pattern(corpora, n_corpora, &patterns[i]);
+
+    for (int i = 0; i < n_corpora; i++)
+        free_corpus(corpora[i]);
+
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: bench [-t ms] [-s bytes] [-f file]...\n");
+    fprintf(stderr, "  -t  how long each measurement runs for at least (default %dms)\n", BENCH_MIN_MS);
+    fprintf(stderr, "  -s  size of each generated corpus (default %d bytes)\n", BENCH_CORPUS_SIZE);
+    fprintf(stderr, "  -f  add a file as a corpus of its own, can be given more than once\n");
+    exit(2);
+}
+
+// Everything for one pattern, every engine on every corpus it's meant for
+static void bench_pattern(Corpus **corpora, int n_corpora, const BenchPattern *p) {
+    BenchRun run;
+    memset(&run, 0, sizeof(BenchRun));
+    run.pattern = p->pattern;
+    run.posix_pattern = p->posix;
+
+    Regex *fast = regex_compile(p->pattern, REGEX_SUPPRESS_LOGGING);
+    Regex *backtrack = regex_compile(p->pattern, REGEX_SUPPRESS_LOGGING | REGEX_BACKTRACK);
+    if (fast == NULL || backtrack == NULL || regcomp(&run.posix, p->posix, REG_EXTENDED) != 0) {
+        fprintf(stderr, "bench: couldn't compile \"%s\"\n", p->pattern);
+        exit(1);
+    }
+
+    // regex_match only uses the DFA (and regex_find the pike VM) when the pattern doesn't need the backtracker
+    Regex *engines[] = {fast->needs_backtrack ? NULL : fast, fast->needs_backtrack ? NULL : fast, backtrack, NULL};
+    BenchFn latency[] = {latency_dfa, latency_find, latency_find, latency_posix};
+    BenchFn scan[] = {scan_dfa, scan_find, scan_find, scan_posix};
+    Result r;
+
+    r = measure(compile_ours, &run);
+    print_row("-", p->pattern, "regex", "compile", 0, &r, 0);
+    r = measure(compile_posix, &run);
+    print_row("-", p->pattern, "posix", "compile", 0, &r, 0);
+
+    for (int i = 0; i < n_corpora; i++) {
+        Corpus *c = corpora[i];
+        if (c->redos != p->redos)
+            continue;
+
+        run.corpus = c;
+        run.results = malloc(sizeof(int) * c->n_lines);
+
+        // Latency is measured on the first line that matches, or the first line if none do
+        long long caps[2 * MAX_CAPTURE_GROUPS];
+        int first = 0;
+        while (first < c->n_lines && !regex_find(fast, c->lines[first].string, c->lines[first].len, caps))
+            first++;
+        if (first == c->n_lines)
+            first = 0;
+
+        char *line = strndup(c->lines[first].string, c->lines[first].len);
+        run.line.string = line;
+        run.line.len = strlen(line);
+
+        long matches = -1;
+        for (int e = 0; e < 4; e++) {
+            if (e != 3 && engines[e] == NULL)
+                continue;
+            run.re = engines[e];
+
+            r = measure(latency[e], &run);
+            print_row(c->name, p->pattern, engine_names[e], "latency", run.line.len, &r, 1);
+
+            r = measure(scan[e], &run);
+            print_row(c->name, p->pattern, engine_names[e], "scan", c->size, &r, 1);
+
+            // POSIX is leftmost longest but that doesn't change which lines have a match in them
+            if (matches != -1 && r.matches != matches)
+                fprintf(stderr, "bench: %s on %s found %ld lines, the engine before found %ld\n",
+                        engine_names[e], c->name, r.matches, matches);
+            matches = r.matches;
+        }
+
+        free(line);
+        free(run.results);
+    }
+
+    regex_free(fast);
+    regex_free(backtrack);
+    regfree(&run.posix);
+}
+
+
+/***** Corpora *****/
+// xorshift64, the corpora come out the same every run
+static unsigned int next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (unsigned int) (seed >> 32);
+}
+
+static Corpus *make_corpus(char *name, size_t size, int redos) {
+    Corpus *c = calloc(1, sizeof(Corpus));
+    c->name = name;
+    c->redos = redos;
+    c->data = malloc(size + 512);
+
+    while (c->size < size) {
+        generate_line(name, c->data + c->size, 512);
+        c->size += strlen(c->data + c->size);
+    }
+
+    split_lines(c);
+    return c;
+}
+
+// One line of whatever kind of corpus name is, with the newline
+static void generate_line(char *name, char *buf, size_t size) {
+    unsigned int r = next_random();
+    int h = r % 24, m = (r >> 5) % 60, s = (r >> 11) % 60;
+
+    if (!strcmp(name, "log")) {
+        if (r % 3 == 0) {
+            snprintf(buf, size, "2024-03-%02d %02d:%02d:%02d host%u sshd[%u]: Accepted password for %s from "
+                    "10.%u.%u.%u port %u\n", 1 + r % 28, h, m, s, r % 50, r % 30000,
+                    log_users[r % 6], r % 256, (r >> 8) % 256, (r >> 16) % 256, 1024 + r % 60000);
+        } else if (r % 3 == 1) {
+            snprintf(buf, size, "192.168.%u.%u - - [%02d/Mar/2024:%02d:%02d:%02d] \"%s %s HTTP/1.1\" %d %u\n",
+                    r % 256, (r >> 8) % 256, 1 + r % 28, h, m, s, (r >> 3) % 2 ? "GET" : "POST",
+                    log_paths[r % 5], (r >> 4) % 10 ? 200 : 404, r % 100000);
+        } else {
+            snprintf(buf, size, "Mar %2d %02d:%02d:%02d kernel: [%u.%06u] %s: worker %u %s\n",
+                    1 + r % 28, h, m, s, r % 100000, (r >> 7) % 1000000, (r >> 9) % 8 ? "info" : "error",
+                    r % 64, (r >> 2) % 4 ? "finished its queue" : "timed out waiting for the lock");
+        }
+
+    } else if (!strcmp(name, "csv")) {
+        const char *first = csv_names[r % 8];
+        const char *last = csv_names[(r >> 3) % 8];
+        snprintf(buf, size, "%u,%s %s,%s.%s@example.com,%s,%u.%02u,2024-%02d-%02d\n", r % 1000000, first, last,
+                first, last, csv_cities[r % 7], r % 10000, (r >> 6) % 100, 1 + r % 12, 1 + (r >> 4) % 28);
+
+    } else if (!strcmp(name, "source")) {
+        snprintf(buf, size, "%s\n", source_lines[r % (sizeof(source_lines) / sizeof(source_lines[0]))]);
+
+    } else {
+        // Long runs that nearly match, which is what makes a backtracker go exponential
+        char ch = "ax0"[r % 3];
+        int len = 20 + r % 12;
+        memset(buf, (ch == '0') ? (char) ('0' + r % 10) : ch, len);
+        strcpy(buf + len, "!\n");
+    }
+}
+
+static Corpus *load_corpus(char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    Corpus *c = calloc(1, sizeof(Corpus));
+    c->name = path;
+    fseek(f, 0, SEEK_END);
+    c->size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    c->data = malloc(c->size + 1);
+    c->size = fread(c->data, 1, c->size, f);
+    fclose(f);
+
+    split_lines(c);
+    return c;
+}
+
+static void split_lines(Corpus *c) {
+    int size = 1024;
+    c->lines = malloc(sizeof(RegexInput) * size);
+
+    for (char *p = c->data; p < c->data + c->size;) {
+        char *nl = memchr(p, '\n', c->data + c->size - p);
+        size_t len = (nl == NULL) ? (size_t) (c->data + c->size - p) : (size_t) (nl - p);
+
+        if (c->n_lines == size) {
+            size *= 2;
+            c->lines = realloc(c->lines, sizeof(RegexInput) * size);
+        }
+        c->lines[c->n_lines].string = p;
+        c->lines[c->n_lines].len = len;
+        c->n_lines++;
+
+        p += len + 1;
+    }
+}
+
+static void free_corpus(Corpus *c) {
+    free(c->data);
+    free(c->lines);
+    free(c);
+}
+
+
+/***** Measuring *****/
+static long perf_event_open(struct perf_event_attr *attr, int group) {
+    return syscall(__NR_perf_event_open, attr, 0, -1, group, 0);
+}
+
+// Cycles, instructions and cache misses as one group so they all count over the same stretch
+static void open_counters(void) {
+    unsigned long long configs[BENCH_N_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+
+    for (int i = 0; i < BENCH_N_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = (i == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        counter_fds[i] = (int) perf_event_open(&attr, (i == 0) ? -1 : counter_fds[0]);
+        if (counter_fds[i] == -1 && i == 0) {
+            fprintf(stderr, "bench: no hardware counters (%s), leaving them out\n", strerror(errno));
+            return;
+        }
+    }
+}
+
+static double elapsed_ns(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+/**
+ * Runs fn over and over until it's been going for min_ns. It runs in batches that double in
+ * size so reading the clock doesn't get counted for the quick ones
+ */
+static Result measure(BenchFn fn, BenchRun *run) {
+    Result r;
+    struct timespec start, end;
+    long long batch = 1;
+    double total = 0;
+
+    // One to warm up the caches and the DFA, which is also where the match count comes from
+    r.matches = fn(run);
+    r.iterations = 0;
+
+    if (counter_fds[0] != -1) {
+        ioctl(counter_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    while (total < min_ns) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long long i = 0; i < batch; i++)
+            fn(run);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double t = elapsed_ns(&start, &end);
+        total += t;
+        r.iterations += batch;
+        if (t < min_ns / 10)
+            batch *= 2;
+    }
+
+    r.ns = total / r.iterations;
+    for (int i = 0; i < BENCH_N_COUNTERS; i++)
+        r.counters[i] = -1;
+
+    if (counter_fds[0] != -1) {
+        unsigned long long values[1 + BENCH_N_COUNTERS];
+        ioctl(counter_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        if (read(counter_fds[0], values, sizeof(values)) > 0) {
+            for (unsigned long long i = 0; i < values[0] && i < BENCH_N_COUNTERS; i++)
+                r.counters[i] = (double) values[1 + i] / r.iterations;
+        }
+    }
+
+    return r;
+}
+
+static void print_row(const char *corpus, const char *pattern, const char *engine, const char *test,
+        size_t bytes, Result *r, int with_matches) {
+    // Patterns have commas in them so they get quoted, with any quotes doubled up
+    printf("%s,\"", corpus);
+    for (const char *p = pattern; *p; p++)
+        printf((*p == '"') ? "\"\"" : "%c", *p);
+    printf("\",%s,%s,%zu,%lld,%.1f,", engine, test, bytes, r->iterations, r->ns);
+
+    if (bytes > 0)
+        printf("%.2f", bytes / r->ns * 1e9 / (1 << 20));
+    printf(",");
+    if (with_matches)
+        printf("%ld", r->matches);
+
+    for (int i = 0; i < BENCH_N_COUNTERS; i++) {
+        printf(",");
+        if (r->counters[i] >= 0)
+            printf("%.0f", r->counters[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+
+/***** What gets measured *****/
+static long compile_ours(BenchRun *run) {
+    regex_free(regex_compile(run->pattern, REGEX_SUPPRESS_LOGGING));
+    return 0;
+}
+
+static long compile_posix(BenchRun *run) {
+    regex_t r;
+    regcomp(&r, run->posix_pattern, REG_EXTENDED);
+    regfree(&r);
+    return 0;
+}
+
+static long latency_dfa(BenchRun *run) {
+    return regex_match(run->re, (char *) run->line.string);
+}
+
+static long latency_find(BenchRun *run) {
+    long long caps[2 * MAX_CAPTURE_GROUPS];
+    return regex_find(run->re, run->line.string, run->line.len, caps);
+}
+
+static long latency_posix(BenchRun *run) {
+    return regexec(&run->posix, run->line.string, 0, NULL, 0) == 0;
+}
+
+static long scan_dfa(BenchRun *run) {
+    Corpus *c = run->corpus;
+    long n = 0;
+
+    regex_match_batch(run->re, c->lines, c->n_lines, run->results, 1);
+    for (int i = 0; i < c->n_lines; i++)
+        n += run->results[i];
+
+    return n;
+}
+
+static long scan_find(BenchRun *run) {
+    Corpus *c = run->corpus;
+    long long caps[2 * MAX_CAPTURE_GROUPS];
+    long n = 0;
+
+    for (int i = 0; i < c->n_lines; i++)
+        n += regex_find(run->re, c->lines[i].string, c->lines[i].len, caps);
+
+    return n;
+}
+
+// REG_STARTEND lets regexec work on the lines where they are instead of copying each one out
+static long scan_posix(BenchRun *run) {
+    Corpus *c = run->corpus;
+    regmatch_t m;
+    long n = 0;
+
+    for (int i = 0; i < c->n_lines; i++) {
+        m.rm_so = 0;
+        m.rm_eo = c->lines[i].len;
+        n += regexec(&run->posix, c->lines[i].string, 1, &m, REG_STARTEND) == 0;
+    }
+
+    return n;
+}
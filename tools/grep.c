@@ -0,0 +1,360 @@
+/**
+ * rgrep - grep-ish line matcher for Linux built on libregex
+ *
+ * Files get mmap'd and cut into chunks that end on a newline, then a pool of threads
+ * matches the chunks line by line. Each chunk keeps its own output so everything still
+ * comes out in file order. Workers ask the kernel for the chunks they'll get to next
+ * so reading the file overlaps with matching it.
+ *
+ * usage: rgrep [-c] [-l] [-b] [-j threads] pattern file...
+ */
+
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "regex.h"
+
+
+
+/***** Defines *****/
+#define GREP_CHUNK_SIZE  (4 << 20)
+#define GREP_MAX_THREADS 64
+#define GREP_READ_AHEAD  2 // How many chunks past the ones being worked on get asked for
+
+
+
+/***** Datatypes *****/
+typedef enum {
+    MODE_PRINT = 0,
+    MODE_COUNT, // -c
+    MODE_LIST,  // -l
+} GrepMode;
+
+typedef struct GrepFile_ {
+    char *name;
+    char *map;
+    size_t size;
+    int found; // Set once anything in the file matches, so -l can skip the rest
+} GrepFile;
+
+// A piece of a file that starts at the beginning of a line and ends after a newline (or at the end)
+typedef struct GrepJob_ {
+    struct GrepFile_ *file;
+    size_t start;
+    size_t end;
+
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    long count;
+    int done;
+} GrepJob;
+
+typedef struct Grep_ {
+    GrepMode mode;
+    int print_offsets; // -b
+    int print_names;
+
+    struct GrepFile_ *files;
+    int n_files;
+    struct GrepJob_ *jobs;
+    int n_jobs;
+    int next_job;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+} Grep;
+
+typedef struct GrepWorker_ {
+    struct Grep_ *grep;
+    Regex *re; // Shared by every thread
+    pthread_t thread;
+} GrepWorker;
+
+
+
+/***** Function Prototypes *****/
+static void usage(void);
+static int open_files(Grep *g, char **names, int n);
+static void make_jobs(Grep *g);
+static void *worker(void *arg);
+static void run_job(Grep *g, Regex *re, GrepJob *job);
+static void job_append(GrepJob *job, const char *s, size_t len);
+static void read_ahead(Grep *g, int job);
+static void print_results(Grep *g);
+
+
+
+int main(int argc, char *argv[]) {
+    Grep g;
+    memset(&g, 0, sizeof(Grep));
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "clbj:")) != -1) {
+        switch (opt) {
+            case 'c': g.mode = MODE_COUNT; break;
+            case 'l': g.mode = MODE_LIST; break;
+            case 'b': g.print_offsets = 1; break;
+            case 'j': n_threads = atol(optarg); break;
+            default: usage();
+        }
+    }
+
+    if (argc - optind < 2)
+        usage();
+
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > GREP_MAX_THREADS)
+        n_threads = GREP_MAX_THREADS;
+
+    char *pattern = argv[optind];
+    int status = open_files(&g, &argv[optind + 1], argc - optind - 1);
+    g.print_names = g.n_files > 1;
+    make_jobs(&g);
+
+    Regex *re = regex_compile(pattern, REGEX_SUPPRESS_LOGGING);
+    if (re == NULL) {
+        fprintf(stderr, "rgrep: bad pattern \"%s\"\n", pattern);
+        return 2;
+    }
+
+    GrepWorker workers[GREP_MAX_THREADS];
+    for (int i = 0; i < n_threads; i++) {
+        workers[i].grep = &g;
+        workers[i].re = re;
+    }
+
+    pthread_mutex_init(&g.lock, NULL);
+    pthread_cond_init(&g.job_done, NULL);
+
+    for (int i = 0; i < n_threads; i++)
+        pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+
+    print_results(&g);
+
+    int found = 0;
+    for (int i = 0; i < n_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    regex_free(re);
+
+    for (int i = 0; i < g.n_files; i++) {
+        found = found || g.files[i].found;
+        if (g.files[i].map != NULL)
+            munmap(g.files[i].map, g.files[i].size);
+    }
+
+    free(g.files);
+    free(g.jobs);
+
+    // Same as grep, 0 if something matched, 1 if nothing did and 2 if something went wrong
+    return status ? 2 : found ? 0 : 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: rgrep [-c] [-l] [-b] [-j threads] pattern file...\n");
+    fprintf(stderr, "  -c  print how many lines matched in each file\n");
+    fprintf(stderr, "  -l  print the names of files with a match\n");
+    fprintf(stderr, "  -b  print the byte offset of each matching line\n");
+    fprintf(stderr, "  -j  number of threads (default is one per core)\n");
+    exit(2);
+}
+
+// Returns non zero if a file couldn't be opened, the rest still get searched
+static int open_files(Grep *g, char **names, int n) {
+    int status = 0;
+    g->files = calloc(n, sizeof(GrepFile));
+
+    for (int i = 0; i < n; i++) {
+        GrepFile *f = &g->files[g->n_files];
+        struct stat st;
+        int fd = open(names[i], O_RDONLY);
+
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            fprintf(stderr, "rgrep: %s: %s\n", names[i], strerror(errno));
+            status = 1;
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+
+        f->name = names[i];
+        f->size = st.st_size;
+
+        // Empty files still get listed with -c
+        if (f->size > 0) {
+            f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (f->map == MAP_FAILED) {
+                fprintf(stderr, "rgrep: %s: %s\n", names[i], strerror(errno));
+                f->map = NULL;
+                status = 1;
+                close(fd);
+                continue;
+            }
+            madvise(f->map, f->size, MADV_SEQUENTIAL);
+        }
+
+        close(fd);
+        g->n_files++;
+    }
+
+    return status;
+}
+
+// Cuts every file into chunks of about GREP_CHUNK_SIZE, moving each cut forward to the next newline
+static void make_jobs(Grep *g) {
+    int size = 16;
+    g->jobs = malloc(sizeof(GrepJob) * size);
+
+    for (int i = 0; i < g->n_files; i++) {
+        GrepFile *f = &g->files[i];
+        size_t start = 0;
+
+        do {
+            size_t end = start + GREP_CHUNK_SIZE;
+            if (end >= f->size) {
+                end = f->size;
+            } else {
+                char *nl = memchr(f->map + end, '\n', f->size - end);
+                end = (nl == NULL) ? f->size : (size_t) (nl - f->map) + 1;
+            }
+
+            if (g->n_jobs == size) {
+                size *= 2;
+                g->jobs = realloc(g->jobs, sizeof(GrepJob) * size);
+            }
+
+            GrepJob *job = &g->jobs[g->n_jobs++];
+            memset(job, 0, sizeof(GrepJob));
+            job->file = f;
+            job->start = start;
+            job->end = end;
+            start = end;
+        } while (start < f->size);
+    }
+}
+
+static void *worker(void *arg) {
+    GrepWorker *w = arg;
+    Grep *g = w->grep;
+
+    while (1) {
+        pthread_mutex_lock(&g->lock);
+        int i = g->next_job++;
+        pthread_mutex_unlock(&g->lock);
+
+        if (i >= g->n_jobs)
+            break;
+
+        read_ahead(g, i);
+        run_job(g, w->re, &g->jobs[i]);
+
+        pthread_mutex_lock(&g->lock);
+        g->jobs[i].done = 1;
+        pthread_cond_broadcast(&g->job_done);
+        pthread_mutex_unlock(&g->lock);
+    }
+
+    return NULL;
+}
+
+static void run_job(Grep *g, Regex *re, GrepJob *job) {
+    GrepFile *f = job->file;
+    char *p = f->map + job->start;
+    char *end = f->map + job->end;
+    char prefix[64];
+
+    while (p < end) {
+        // Somebody else already found one, nothing left to do for -l
+        if (g->mode == MODE_LIST && __atomic_load_n(&f->found, __ATOMIC_RELAXED))
+            return;
+
+        char *nl = memchr(p, '\n', end - p);
+        size_t len = (nl == NULL) ? (size_t) (end - p) : (size_t) (nl - p);
+
+        // Matched where it is in the map, the line doesn't end in a NUL
+        if (regex_match_len(re, p, len)) {
+            job->count++;
+            __atomic_store_n(&f->found, 1, __ATOMIC_RELAXED);
+
+            if (g->mode == MODE_PRINT) {
+                if (g->print_names) {
+                    job_append(job, f->name, strlen(f->name));
+                    job_append(job, ":", 1);
+                }
+                if (g->print_offsets) {
+                    int n = snprintf(prefix, sizeof(prefix), "%zu:", (size_t) (p - f->map));
+                    job_append(job, prefix, n);
+                }
+                job_append(job, p, len);
+                job_append(job, "\n", 1);
+            }
+        }
+
+        p += len + 1;
+    }
+}
+
+static void job_append(GrepJob *job, const char *s, size_t len) {
+    if (job->out_len + len > job->out_size) {
+        job->out_size = job->out_size ? job->out_size : 4096;
+        while (job->out_len + len > job->out_size)
+            job->out_size *= 2;
+        job->out = realloc(job->out, job->out_size);
+    }
+
+    memcpy(job->out + job->out_len, s, len);
+    job->out_len += len;
+}
+
+// Asks for the chunk the next round of workers is going to want so it's in memory by the time they get there
+static void read_ahead(Grep *g, int job) {
+    for (int i = job + 1; i <= job + GREP_READ_AHEAD && i < g->n_jobs; i++) {
+        GrepJob *j = &g->jobs[i];
+        long page = sysconf(_SC_PAGESIZE);
+        size_t start = j->start & ~(size_t) (page - 1);
+
+        madvise(j->file->map + start, j->end - start, MADV_WILLNEED);
+    }
+}
+
+// Prints each job's output as soon as it and everything before it are done, so it all stays in order
+static void print_results(Grep *g) {
+    long count = 0;
+
+    for (int i = 0; i < g->n_jobs; i++) {
+        GrepJob *job = &g->jobs[i];
+
+        pthread_mutex_lock(&g->lock);
+        while (!job->done)
+            pthread_cond_wait(&g->job_done, &g->lock);
+        pthread_mutex_unlock(&g->lock);
+
+        if (job->out_len > 0)
+            fwrite(job->out, 1, job->out_len, stdout);
+        free(job->out);
+        count += job->count;
+
+        // The last chunk of a file
+        if (i + 1 == g->n_jobs || g->jobs[i + 1].file != job->file) {
+            if (g->mode == MODE_COUNT && g->print_names)
+                printf("%s:%ld\n", job->file->name, count);
+            else if (g->mode == MODE_COUNT)
+                printf("%ld\n", count);
+            else if (g->mode == MODE_LIST && job->file->found)
+                printf("%s\n", job->file->name);
+            count = 0;
+        }
+    }
+}
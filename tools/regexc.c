@@ -0,0 +1,315 @@
+/**
+ * regexc - turns a pattern that's fixed when the program is built into C source
+ *
+ * The pattern goes through the library's own parser and optimizer, then dfa_build works out the
+ * whole DFA up front (the same states the lazy DFA in dfa.c would cache) and it gets written out
+ * as a label per state with a switch on the next byte. The generated function
+ * doesn't need libregex, never allocates and doesn't interpret anything, every byte is one
+ * switch and a goto.
+ *
+ * By default the function gives the same answer as regex_match, whether there's a (non-empty)
+ * match anywhere in the input. With -x the whole input has to match, which is what a validator
+ * wants. Back references and the counting loops that big {n,m} turn into need the backtracker,
+ * so those patterns get refused, as does anything whose DFA would have more than GEN_MAX_STATES
+ *
+ * usage: regexc [-x] [-n name] [-o file] (-f file | pattern)
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "regex_internal.h"
+
+
+
+/***** Defines *****/
+#define GEN_MAX_STATES   4096
+#define GEN_MAX_PATTERN  4096
+
+
+
+/***** Datatypes *****/
+typedef struct Gen_ {
+    Regex *re;
+    int whole; // -x
+
+    // From dfa_build
+    int n_states;
+    int *next; // 256 transitions a state
+    int *accepts; // With -x, the input matches if it ends here
+    char *used; // Something jumps to its label
+} Gen;
+
+
+
+/***** Function Prototypes *****/
+static int build_dfa(Gen *g);
+
+static void write_source(Gen *g, FILE *f, const char *name, const char *pattern);
+static void write_state(Gen *g, FILE *f, int d);
+static void write_target(Gen *g, FILE *f, int target);
+static void write_byte(FILE *f, int ch);
+
+static char *read_pattern(const char *path);
+static int valid_name(const char *name);
+static void usage(void);
+
+
+
+int main(int argc, char *argv[]) {
+    const char *name = "regex_fixed";
+    const char *out = NULL;
+    const char *file = NULL;
+    char *pattern = NULL;
+    Gen g;
+    memset(&g, 0, sizeof(Gen));
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (!strcmp(argv[i], "-x")) {
+            g.whole = 1;
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            name = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            out = argv[++i];
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            file = argv[++i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (file != NULL && i == argc) {
+        pattern = read_pattern(file);
+        if (pattern == NULL)
+            return 2;
+    } else if (file == NULL && i == argc - 1) {
+        pattern = strdup(argv[i]);
+    } else {
+        usage();
+        return 2;
+    }
+
+    if (!valid_name(name)) {
+        fprintf(stderr, "regexc: \"%s\" isn't a C identifier\n", name);
+        free(pattern);
+        return 2;
+    }
+
+    g.re = regex_compile(pattern, REGEX_SUPPRESS_LOGGING);
+    if (g.re == NULL) {
+        fprintf(stderr, "regexc: couldn't compile \"%s\"\n", pattern);
+        free(pattern);
+        return 1;
+    }
+
+    if (g.re->needs_backtrack) {
+        fprintf(stderr, "regexc: \"%s\" needs the backtracker (back references or a big {n,m}), "
+                "it can't be turned into a DFA\n", pattern);
+        regex_free(g.re);
+        free(pattern);
+        return 1;
+    }
+
+    int rtn = 0;
+    if (!build_dfa(&g)) {
+        fprintf(stderr, "regexc: \"%s\" needs more than %d DFA states\n", pattern, GEN_MAX_STATES);
+        rtn = 1;
+    } else {
+        FILE *f = (out == NULL) ? stdout : fopen(out, "w");
+        if (f == NULL) {
+            perror(out);
+            rtn = 2;
+        } else {
+            write_source(&g, f, name, pattern);
+            if (f != stdout)
+                fclose(f);
+        }
+    }
+
+    free(g.next);
+    free(g.accepts);
+    free(g.used);
+    regex_free(g.re);
+    free(pattern);
+
+    return rtn;
+}
+
+
+
+/***** Building the DFA *****/
+// Works out every state the DFA can get to, state 0 is the initial one. Returns 0 if there are too many
+static int build_dfa(Gen *g) {
+    // Every state has to be in the cache at once
+    regex_set_dfa_memory(g->re, SIZE_MAX);
+
+    g->n_states = dfa_build(g->re, g->whole, GEN_MAX_STATES, &g->next, &g->accepts);
+    if (g->n_states == 0)
+        return 0;
+
+    g->used = calloc(g->n_states, 1);
+    for (int i = 0; i < 256 * g->n_states; i++)
+        if (g->next[i] >= 0)
+            g->used[g->next[i]] = 1;
+
+    return 1;
+}
+
+
+
+/***** Writing it out *****/
+static void write_source(Gen *g, FILE *f, const char *name, const char *pattern) {
+    fprintf(f, "/**\n * Generated by regexc, don't edit. Pattern:\n *   ");
+
+    // Something like a*/ would end the comment early
+    for (const char *c = pattern; *c; c++) {
+        fputc(*c, f);
+        if (*c == '*' && c[1] == '/')
+            fputc(' ', f);
+    }
+
+    fprintf(f, "\n *\n * int %s(const char *string, size_t len);\n", name);
+    if (g->whole)
+        fprintf(f, " * Returns 1 if all of string matches the pattern\n");
+    else
+        fprintf(f, " * Returns 1 if string contains a match, the same answer regex_match gives\n");
+    fprintf(f, " * %d states, nothing gets allocated and string doesn't need to be NUL terminated\n */\n\n",
+            g->n_states);
+
+    fprintf(f, "#include <stddef.h>\n\n");
+    fprintf(f, "int %s(const char *string, size_t len) {\n", name);
+    fprintf(f, "    const unsigned char *p = (const unsigned char *) string;\n");
+    fprintf(f, "    const unsigned char *end = p + len;\n");
+
+    for (int d = 0; d < g->n_states; d++)
+        write_state(g, f, d);
+
+    fprintf(f, "}\n");
+}
+
+// The label, what to do if the input ends here, then a case for every byte that doesn't go to the default
+static void write_state(Gen *g, FILE *f, int d) {
+    const int *next = &g->next[256 * d];
+
+    fprintf(f, "\n");
+    if (g->used[d])
+        fprintf(f, "s%d:\n", d);
+    fprintf(f, "    if (p == end)\n        return %d;\n", g->accepts[d]);
+
+    // The most common target is the default so it doesn't need listing
+    int dflt = next[0], best = 0;
+    for (int ch = 0; ch < 256; ch++) {
+        int count = 0;
+        for (int c = 0; c < 256; c++)
+            count += (next[c] == next[ch]);
+        if (count > best) {
+            best = count;
+            dflt = next[ch];
+        }
+    }
+
+    if (best == 256) {
+        fprintf(f, "    p++;\n    ");
+        write_target(g, f, dflt);
+        return;
+    }
+
+    fprintf(f, "    switch (*p++) {\n");
+
+    // Every target gets its bytes listed together
+    char *done = calloc(256, 1);
+    for (int ch = 0; ch < 256; ch++) {
+        int target = next[ch];
+        if (done[ch] || target == dflt)
+            continue;
+
+        int on_line = 0;
+        fprintf(f, "        ");
+        for (int c = ch; c < 256; c++) {
+            if (next[c] != target)
+                continue;
+            done[c] = 1;
+
+            if (on_line == 8) {
+                fprintf(f, "\n        ");
+                on_line = 0;
+            }
+            fprintf(f, "%scase ", on_line ? " " : "");
+            write_byte(f, c);
+            fprintf(f, ":");
+            on_line++;
+        }
+        fprintf(f, "\n            ");
+        write_target(g, f, target);
+    }
+    free(done);
+
+    fprintf(f, "        default:\n            ");
+    write_target(g, f, dflt);
+    fprintf(f, "    }\n");
+}
+
+static void write_target(Gen *g, FILE *f, int target) {
+    (void) g;
+
+    if (target == DFA_TO_MATCH)
+        fprintf(f, "return 1;\n");
+    else if (target == DFA_TO_DEAD)
+        fprintf(f, "return 0;\n");
+    else
+        fprintf(f, "goto s%d;\n", target);
+}
+
+static void write_byte(FILE *f, int ch) {
+    if (ch == '\'' || ch == '\\')
+        fprintf(f, "'\\%c'", ch);
+    else if (ch >= 0x20 && ch < 0x7F)
+        fprintf(f, "'%c'", ch);
+    else
+        fprintf(f, "0x%02X", ch);
+}
+
+
+
+/***** Utility functions *****/
+// The first line of the file, so a pattern can't end up with a newline on it by accident
+static char *read_pattern(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    char *pattern = malloc(GEN_MAX_PATTERN);
+    if (fgets(pattern, GEN_MAX_PATTERN, f) == NULL)
+        pattern[0] = '\0';
+    fclose(f);
+
+    pattern[strcspn(pattern, "\r\n")] = '\0';
+    return pattern;
+}
+
+static int valid_name(const char *name) {
+    if (!(*name == '_' || (*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z')))
+        return 0;
+
+    for (const char *c = name; *c; c++)
+        if (!(*c == '_' || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')))
+            return 0;
+
+    return 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: regexc [-x] [-n name] [-o file] (-f file | pattern)\n"
+                    "  -x       the whole input has to match, instead of a match anywhere in it\n"
+                    "  -n name  what the generated function is called (regex_fixed)\n"
+                    "  -o file  write the C there instead of stdout\n"
+                    "  -f file  read the pattern from the first line of file\n");
+}